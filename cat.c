@@ -0,0 +1,46 @@
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "copy_fd.h"
+
+int cat_main(int argc, char *argv[]) {
+    // Write your code here
+    // Do not write a main() function. Instead, deal with cat_main() as the main function of your program.
+    struct stat out_st;
+    if (fstat(STDOUT_FILENO, &out_st) == -1) {
+        perror("cat: stdout");
+        return 1;
+    }
+
+    int status = 0;
+    int file_count = argc > 1 ? argc - 1 : 1;
+    for (int i = 0; i < file_count; i++) {
+        const char *path = argc > 1 ? argv[i + 1] : "-";
+        int in_fd = STDIN_FILENO;
+        if (strcmp(path, "-") != 0) {
+            in_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (in_fd == -1) {
+                fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+        int result = copy_fd(in_fd, STDOUT_FILENO, &out_st);
+        if (result == COPY_SAME_FILE) {
+            fprintf(stderr, "cat: %s: input file is output file\n", path);
+            status = 1;
+        } else if (result == COPY_FAILED) {
+            fprintf(stderr, "cat: %s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+        if (in_fd != STDIN_FILENO) {
+            close(in_fd);
+        }
+    }
+    return status;
+}
@@ -0,0 +1,143 @@
+// Copying one fd to another with the cheapest method the two fds allow.
+// Shared by cat.c and microShell.c's cat builtin.
+#ifndef COPY_FD_H
+#define COPY_FD_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+#ifndef SPLICE_F_MORE
+#define SPLICE_F_MORE 4
+#endif
+
+// Bytes requested per splice/sendfile/copy_file_range call
+#define COPY_CHUNK_SIZE (1 << 30)
+// Buffer for the plain read/write fallback
+#define COPY_BUFFER_SIZE (128 * 1024)
+
+// Result of a copy. COPY_SAME_FILE: the input is the output file itself
+// and copying would never reach EOF.
+enum { COPY_DONE, COPY_UNSUPPORTED, COPY_FAILED, COPY_SAME_FILE };
+
+// Each zero-copy path moves data until EOF. COPY_UNSUPPORTED means the
+// kernel refused this combination of fds; the file offset is wherever the
+// copy stopped, so the next method simply carries on from there.
+static int copy_splice(int in_fd, int out_fd) {
+    while (1) {
+        ssize_t n = syscall(SYS_splice, in_fd, NULL, out_fd, NULL, (size_t)COPY_CHUNK_SIZE,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) {
+            return COPY_DONE;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EINVAL || errno == ENOSYS) ? COPY_UNSUPPORTED : COPY_FAILED;
+        }
+    }
+}
+
+static int copy_file_range_loop(int in_fd, int out_fd) {
+    while (1) {
+        ssize_t n = syscall(SYS_copy_file_range, in_fd, NULL, out_fd, NULL,
+                            (size_t)COPY_CHUNK_SIZE, 0);
+        if (n == 0) {
+            return COPY_DONE;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EBADF ||
+                    errno == EOPNOTSUPP) ? COPY_UNSUPPORTED : COPY_FAILED;
+        }
+    }
+}
+
+static int copy_sendfile(int in_fd, int out_fd) {
+    while (1) {
+        ssize_t n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+        if (n == 0) {
+            return COPY_DONE;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EINVAL || errno == ENOSYS) ? COPY_UNSUPPORTED : COPY_FAILED;
+        }
+    }
+}
+
+// The buffer is allocated per call so that threads can copy concurrently
+static int copy_buffered(int in_fd, int out_fd) {
+    char *buffer = (char *)malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        return COPY_FAILED;
+    }
+    int result = COPY_DONE;
+    while (result == COPY_DONE) {
+        ssize_t bytes_read = read(in_fd, buffer, COPY_BUFFER_SIZE);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            result = bytes_read == 0 ? COPY_DONE : COPY_FAILED;
+            break;
+        }
+        char *p = buffer;
+        while (bytes_read > 0) {
+            ssize_t bytes_written = write(out_fd, p, bytes_read);
+            if (bytes_written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                result = COPY_FAILED;
+                break;
+            }
+            p += bytes_written;
+            bytes_read -= bytes_written;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+// Copy in_fd to out_fd: splice into a pipe, copy_file_range between
+// regular files, sendfile from a regular file (e.g. to a socket), else a
+// large buffer. Like GNU cat, refuses to copy a regular file onto itself
+// unless the input is already at its end ("cat f > f" truncated it).
+static int copy_fd(int in_fd, int out_fd, const struct stat *out_st) {
+    struct stat in_st;
+    if (fstat(in_fd, &in_st) == -1) {
+        return COPY_FAILED;
+    }
+    if (S_ISREG(in_st.st_mode) && in_st.st_dev == out_st->st_dev &&
+        in_st.st_ino == out_st->st_ino && lseek(in_fd, 0, SEEK_CUR) < in_st.st_size) {
+        return COPY_SAME_FILE;
+    }
+    int result = COPY_UNSUPPORTED;
+    if (S_ISFIFO(out_st->st_mode) || S_ISFIFO(in_st.st_mode)) {
+        result = copy_splice(in_fd, out_fd);
+    }
+    if (result == COPY_UNSUPPORTED && S_ISREG(in_st.st_mode) && S_ISREG(out_st->st_mode)) {
+        result = copy_file_range_loop(in_fd, out_fd);
+    }
+    if (result == COPY_UNSUPPORTED && S_ISREG(in_st.st_mode)) {
+        result = copy_sendfile(in_fd, out_fd);
+    }
+    if (result == COPY_UNSUPPORTED) {
+        result = copy_buffered(in_fd, out_fd);
+    }
+    return result;
+}
+
+#endif
@@ -5,9 +5,71 @@
 #include <sys/wait.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <termios.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "copy_fd.h"
+
+// The lexer's delimiter scan uses SSE2 (baseline on x86-64) and AVX2 when
+// the CPU has it; other targets use the plain byte loop.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LEXER_SIMD 1
+#endif
 
 #define PROMPT "pico$ "
-#define MAX_ARGS 128
+#define PROMPT2 "> "
+
+// Server mode frame types (1 byte type + 4 byte big-endian length + payload)
+#define FRAME_STDOUT '1'
+#define FRAME_STDERR '2'
+#define FRAME_EXIT 'x'
+// Largest payload either side accepts; a longer frame ends the connection
+#define FRAME_MAX (64 * 1024 * 1024)
+
+// Exit status reported when a command runs past its deadline (as timeout(1))
+#define TIMEOUT_STATUS 124
+// Grace period between SIGTERM and SIGKILL once a deadline expires
+#define KILL_AFTER_MS 1000
+// Longest duration parse_duration() accepts, with room left for deadlines
+#define MAX_DURATION_MS ((double)(LONG_MAX / 2))
+
+// Session stdout is written out once this much has accumulated
+#define OUTPUT_BUFFER_SIZE 65536
+
+// Block size used by the read builtin
+#define READ_BUFFER_SIZE 65536
+
+// Tab completion: candidates shown at most on a double Tab
+#define MAX_COMPLETIONS_SHOWN 200
+
+// Line editing: how long to wait for the rest of an escape sequence
+// before taking ESC as a key of its own
+#define ESCAPE_TIMEOUT_MS 50
+
+// History: entries kept in memory, name of the log under $HOME, and the
+// block size reverse search scans the log in
+#define HISTORY_SIZE 1000
+#define HISTORY_FILE ".microshell_history"
+#define HISTORY_SEARCH_BLOCK 65536
+
+// Trace sink ring buffer: slots (power of two) and events per flush
+#define TRACE_RING_SIZE 256
+#define TRACE_BATCH 64
 
 typedef struct {
     char *name;
@@ -15,21 +77,291 @@ typedef struct {
     int exported;
 } ShellVar;
 
-ShellVar *variables = NULL;
-int var_count = 0;
+// Growable string used by the expander and the trace sink
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} StrBuf;
+
+// Script tokens: words plus the control operators that separate commands
+typedef enum {
+    TOK_WORD,
+    TOK_SEMI,
+    TOK_NEWLINE,
+    TOK_AND,
+    TOK_OR,
+    TOK_PIPE,
+    TOK_REDIRECT,   // <, >, >>, 2>, 2>> (text holds the operator)
+    TOK_EOF
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    char *text;
+} Token;
+
+// Parsed script tree. Loop bodies are executed straight from this tree,
+// so a script is lexed and parsed exactly once no matter how often it runs.
+typedef enum {
+    NODE_COMMAND,   // words
+    NODE_LIST,      // children, run in order
+    NODE_AND,       // cond && body
+    NODE_OR,        // cond || body
+    NODE_IF,        // if cond; then body; else alt; fi
+    NODE_FOR,       // for name in words; do body; done
+    NODE_WHILE,     // while cond; do body; done
+    NODE_UNTIL,     // until cond; do body; done
+    NODE_PIPELINE   // children, stdout of each into stdin of the next
+} NodeType;
+
+// Redirection of fd 0, 1 or 2 to target (still unexpanded)
+typedef struct {
+    int fd;
+    int flags;      // open(2) flags
+    char *target;
+} Redirect;
+
+typedef struct Node {
+    NodeType type;
+    char **words;       // kept unexpanded, quotes included
+    int word_count;
+    Redirect *redirs;
+    int redir_count;
+    char *name;
+    struct Node **children;
+    int child_count;
+    struct Node *cond;
+    struct Node *body;
+    struct Node *alt;
+} Node;
+
+typedef struct {
+    Token *tokens;
+    int count;
+    int pos;
+    int incomplete;     // ran out of input inside a construct
+    int error;
+    struct ShellContext *ctx;   // where syntax errors are reported
+} Parser;
+
+enum { PARSE_OK, PARSE_INCOMPLETE, PARSE_ERROR };
+
+// How far shell_eval() got through the pending lines: enough to tell when
+// they close without lexing and parsing all of them again on every line
+typedef struct {
+    size_t lexed;       // pending text already split into tokens
+    int depth;          // if/for/while/until not closed yet
+    int state;          // where the next word is, see below
+    int redirect;       // the next word is a redirection target
+    int continued;      // the last token was |, && or ||
+} PendingScan;
+
+enum {
+    SCAN_COMMAND,       // where a command starts: reserved words count
+    SCAN_ARGS,          // in the words of a command or a for header
+    SCAN_CLOSED         // after fi/done: only closing words count
+};
+
+// Block buffer behind the read builtin. It is shared by every read of the
+// same stdin, so a while-read loop issues one read(2) per block instead of
+// one per byte. Data read ahead from a regular file is given back with
+// lseek() before stdin changes or another process gets to use it.
+typedef struct {
+    char *data;
+    size_t cap;
+    size_t start;       // next unread byte
+    size_t end;         // end of valid data
+    dev_t dev;          // identity of the file the data came from
+    ino_t ino;
+    int seekable;
+    unsigned long generation;
+} ReadBuffer;
+
+// CLOCK_MONOTONIC timestamps (ns) of one traced command; 0 = did not happen
+typedef struct {
+    long long parse_start;
+    long long parse_end;
+    long long expand;
+    long long fork;
+    long long exec;
+    long long wait;
+    long long end;
+    pid_t pid;
+    StrBuf redirections;    // JSON of the targets apply_redirections() opened
+} TraceTimes;
+
+// Lock-free ring of formatted JSON lines. Producers claim a slot with an
+// atomic increment of head and publish it through its ready flag; whoever
+// holds the flushing flag drains ready slots from tail in one write().
+typedef struct {
+    char *line;
+    int ready;
+} TraceSlot;
+
+typedef struct {
+    TraceSlot slots[TRACE_RING_SIZE];
+    unsigned long head;
+    unsigned long tail;
+    int flushing;
+    int fd;
+} TraceRing;
+
+// Page shared by a traced session, its subshells and forked children:
+// the event counter, so seq is unique across all of them, and the slot a
+// forked command stamps its exec time in (each forked shell maps a page
+// of its own for that, see trace_forked())
+typedef struct {
+    unsigned long seq;
+    long long exec_stamp;
+} TraceShared;
+
+// Command history. The log file is append-only, one entry per line; a
+// newline inside an entry is stored as newline + tab. It is mapped once
+// when the session opens it, so start-up costs the same for ten entries
+// or a million, and only the newest HISTORY_SIZE entries are indexed.
+// Entries added later are appended to the file with O_APPEND (so
+// sessions sharing a log interleave whole lines) and kept in added.
+typedef struct {
+    size_t off;             // into the log: the mapping, then added
+    size_t len;
+} HistoryEntry;
+
+typedef struct {
+    int enabled;
+    int fd;                 // -1 when the history is not saved
+    char *map;
+    size_t map_len;
+    StrBuf added;
+    HistoryEntry *entries;  // ring, oldest at first
+    int first;
+    int count;
+    int base;               // number of the oldest entry
+    int torn;               // the log did not end with a newline
+} History;
+
+// One shell session. Everything a command can change lives here rather
+// than in the process, so any number of sessions can run side by side in
+// one process, each on its own thread if need be: relative paths are
+// resolved against cwd_fd with the *at() calls, and commands use fds[]
+// in place of fds 0-2, which are only set up in forked children.
+typedef struct ShellContext {
+    ShellVar *variables;
+    int var_count;
+
+    int fds[3];             // the session's stdin, stdout and stderr
+    FILE *script_input;     // stream on fds[0] the script itself comes from, if any
+    StrBuf out;             // output not yet written to fds[1]
+    int out_is_tty;         // write out at every newline
+
+    int cwd_fd;
+    char *cwd;
+
+    StrBuf pending;         // lines of a command that is not complete yet
+    PendingScan pending_scan;
+
+    int last_status;
+    int substitutions;      // "$(...)" run so far; see execute_command()
+    int exit_requested;
+    int loop_break;
+    int loop_continue;
+    int loop_depth;
+
+    // Per-command deadline for external commands (set -o timeout=DUR), 0 = none
+    long command_timeout_ms;
+
+    // set -x
+    int xtrace;
+
+    ReadBuffer read_buffer;
+    // Bumped every time the session points fds[0] somewhere else
+    unsigned long stdin_generation;
+    // Number of active redirections of fd 0; at zero, stdin is the script itself
+    int stdin_redirect_depth;
+
+    // Pipeline stage forked for a single command: exec it without another fork
+    int exec_in_place;
+    // A pipeline stage or "$(...)"; from shell_subshell(), the history is
+    // only borrowed
+    int subshell;
+    // stdout is a pipe whose reader has gone
+    int broken_pipe;
+
+    TraceRing trace_ring;
+    // Times of the command being run, or NULL when the trace sink is off
+    TraceTimes *current_trace;
+    // Parse times of the script currently executing
+    long long script_parse_start;
+    long long script_parse_end;
+    TraceShared *trace_shared;
+    long long *trace_exec_stamp;    // in trace_shared, or a forked shell's own page
+
+    History history;
+} ShellContext;
+
+// Embedding API: a session reads commands through shell_eval() and
+// writes only to the fds it was created with
+ShellContext *shell_create(int in_fd, int out_fd, int err_fd);
+void shell_destroy(ShellContext *ctx);
+int shell_eval(ShellContext *ctx, const char *line);
+int shell_incomplete(ShellContext *ctx);
+int shell_exited(ShellContext *ctx);
+int shell_history_open(ShellContext *ctx, const char *path);
+
+// The process environment, passed on to commands with the exported variables
+extern char **environ;
 
 // Function declarations
-int echo(char **args, int arg_count);
-int pwd();
-int cd(char **args, int arg_count);
-char **parse_command(char *input, int *arg_count);
+int echo(ShellContext *ctx, char **args, int arg_count);
+int pwd(ShellContext *ctx);
+int cd(ShellContext *ctx, char **args, int arg_count);
 void free_args(char **args, int arg_count);
-int execute_external(char **args, int arg_count);
-int handle_redirections(char **args, int *arg_count);
-void substitute_variables(char **args, int arg_count);
-void add_or_update_var(const char *name, const char *value, int exported);
-const char *get_var_value(const char *name);
-void export_var(const char *name);
+int execute_external(ShellContext *ctx, char **args);
+int run_external(ShellContext *ctx, char **args, long timeout_ms, long kill_after_ms);
+int wait_for_child(ShellContext *ctx, pid_t pid, long timeout_ms, long kill_after_ms);
+long parse_duration(const char *text);
+int timeout_builtin(ShellContext *ctx, char **args, int arg_count);
+int set_builtin(ShellContext *ctx, char **args, int arg_count);
+int read_builtin(ShellContext *ctx, char **args, int arg_count);
+int cat_builtin(ShellContext *ctx, char **args, int arg_count);
+void read_buffer_sync(ShellContext *ctx);
+long long monotonic_ns();
+int trace_open(ShellContext *ctx, const char *path);
+void trace_close(ShellContext *ctx);
+void trace_flush(ShellContext *ctx);
+void trace_record(ShellContext *ctx, char **args, int arg_count, int status, TraceTimes *times);
+void xtrace_print(ShellContext *ctx, char **args, int arg_count);
+static void trace_redirection(TraceTimes *times, int fd, int flags, const char *target);
+static void trace_forked(ShellContext *ctx);
+static int write_all(int fd, const void *data, size_t len);
+static void sb_append(StrBuf *sb, const char *text, size_t len);
+void shell_flush(ShellContext *ctx);
+void shell_write(ShellContext *ctx, int fd, const char *data, size_t len);
+void shell_printf(ShellContext *ctx, int fd, const char *format, ...);
+int apply_redirections(ShellContext *ctx, Redirect *redirs, int redir_count, int saved[3]);
+void restore_redirections(ShellContext *ctx, int saved[3]);
+char *expand_word(ShellContext *ctx, const char *word);
+const char *scan_special(const char *p, const char *end);
+static const char *scan_substitution(const char *p, const char *end, int *incomplete);
+void substitute_variables(ShellContext *ctx, char **args, int arg_count);
+void add_or_update_var(ShellContext *ctx, const char *name, const char *value, int exported);
+const char *get_var_value(ShellContext *ctx, const char *name);
+void export_var(ShellContext *ctx, const char *name);
+Token *tokenize(const char *input, int *token_count, int *incomplete);
+void free_tokens(Token *tokens, int token_count);
+int parse_script(ShellContext *ctx, const char *script, Node **out);
+void free_node(Node *node);
+int execute_node(ShellContext *ctx, Node *node);
+int execute_command(ShellContext *ctx, Node *node);
+int run_script(ShellContext *ctx, const char *script);
+int run_server(ShellContext *ctx, const char *socket_path, const char *init_file);
+int run_client(const char *socket_path);
+ssize_t line_edit(ShellContext *ctx, const char *prompt, char **buffer, size_t *buffer_size);
+void history_add(ShellContext *ctx, const char *entry);
+void history_close(ShellContext *ctx);
+char *history_get(ShellContext *ctx, int number);
+int history_builtin(ShellContext *ctx, char **args, int arg_count);
+char *history_expand(ShellContext *ctx, const char *line, int *expanded);
 
 int microshell_main(int argc, char *argv[]) {
     char *buffer = NULL;
@@ -37,349 +369,4083 @@ int microshell_main(int argc, char *argv[]) {
     ssize_t bytes_read;
     int status = 0;
 
-    while (1) {
-        char cwd[PATH_MAX];
-        // Prompt display (disabled for testing)
-        if (getcwd(cwd, sizeof(cwd)) && false) {
-            printf("%s %s", cwd, PROMPT);
-        } else {
-            printf(PROMPT);
-            fflush(stdout);
+    if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+        return run_client(argv[2]);
+    }
+
+    ShellContext *ctx = shell_create(STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
+    if (!ctx) {
+        perror("microshell");
+        return 1;
+    }
+    // The script comes from stdin too; the read builtin shares its buffer
+    ctx->script_input = stdin;
+
+    if (argc >= 3 && strcmp(argv[1], "--server") == 0) {
+        status = run_server(ctx, argv[2], argc >= 4 ? argv[3] : NULL);
+        shell_destroy(ctx);
+        return status;
+    }
+
+    // Line editing, history and completion only when talking to a terminal
+    int interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    if (interactive) {
+        const char *histfile = getenv("HISTFILE");
+        const char *home = getenv("HOME");
+        char path[PATH_MAX];
+        if (!histfile && home) {
+            snprintf(path, sizeof(path), "%s/%s", home, HISTORY_FILE);
+            histfile = path;
         }
+        shell_history_open(ctx, histfile);
+    }
 
-        bytes_read = getline(&buffer, &buffer_size, stdin);
+    while (!shell_exited(ctx)) {
+        const char *prompt = shell_incomplete(ctx) ? PROMPT2 : PROMPT;
+        if (interactive) {
+            bytes_read = line_edit(ctx, prompt, &buffer, &buffer_size);
+        } else {
+            // Prompt display (no cwd, for testing)
+            shell_write(ctx, STDOUT_FILENO, prompt, strlen(prompt));
+            shell_flush(ctx);
+            bytes_read = getline(&buffer, &buffer_size, stdin);
+        }
         if (bytes_read == -1) {
+            if (shell_incomplete(ctx)) {
+                shell_printf(ctx, STDOUT_FILENO, "syntax error: unexpected end of file\n");
+                status = 2;
+            }
             break;
         }
 
         // Strip newline
         if (bytes_read > 0 && buffer[bytes_read - 1] == '\n') {
-            buffer[bytes_read - 1] = '\0';
+            buffer[--bytes_read] = '\0';
         }
 
-        // Handle assignment line (x=5)
-        char *eq_ptr = strchr(buffer, '=');
-        if (eq_ptr && buffer[0] != '=' && strchr(buffer, ' ') == NULL) {
-            *eq_ptr = '\0';
-            const char *name = buffer;
-            const char *value = eq_ptr + 1;
-            if (*name == '\0' || *value == '\0') {
-                printf("Invalid command\n");
-            } else {
-                add_or_update_var(name, value, 0);
-            }
-            continue;
-        }
-
-        // Parse command
-        int arg_count = 0;
-        char **args = parse_command(buffer, &arg_count);
-
-        if (arg_count == 0) {
-            free_args(args, arg_count);
+        int result = shell_eval(ctx, buffer);
+        if (shell_incomplete(ctx)) {
             continue;
         }
-
-        if (strcmp(args[0], "exit") == 0) {
-            printf("Good Bye\n");
-            free_args(args, arg_count);
-            break;
-        } else if (strcmp(args[0], "echo") == 0) {
-            substitute_variables(args, arg_count);
-            status = echo(args, arg_count);
-
-        } else if (strcmp(args[0], "pwd") == 0) {
-            status = pwd();
-
-        } else if (strcmp(args[0], "cd") == 0) {
-            substitute_variables(args, arg_count);
-            status = cd(args, arg_count);
-        } else if (strcmp(args[0], "export") == 0) {
-            if (arg_count < 2) {
-                printf("export: missing argument\n");
-            } else {
-                export_var(args[1]);
-            }
-            status = 0;
-        } else {
-            substitute_variables(args, arg_count);
-            status = execute_external(args, arg_count);
-        }
-
-        free_args(args, arg_count);
+        status = result;
     }
 
     free(buffer);
+    shell_destroy(ctx);
+    return status;
+}
 
-    // Free all variables
-    for (int i = 0; i < var_count; i++) {
-        free(variables[i].name);
-        free(variables[i].value);
+// Start a session reading from in_fd and writing to out_fd and err_fd.
+// The fds stay owned by the caller. Returns NULL if the current directory
+// cannot be opened.
+ShellContext *shell_create(int in_fd, int out_fd, int err_fd) {
+    ShellContext *ctx = (ShellContext *)calloc(1, sizeof(ShellContext));
+    if (!ctx) {
+        return NULL;
     }
-    free(variables);
+    ctx->cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ctx->cwd_fd == -1) {
+        free(ctx);
+        return NULL;
+    }
+    char cwd[PATH_MAX];
+    ctx->cwd = strdup(getcwd(cwd, sizeof(cwd)) ? cwd : ".");
+    ctx->fds[STDIN_FILENO] = in_fd;
+    ctx->fds[STDOUT_FILENO] = out_fd;
+    ctx->fds[STDERR_FILENO] = err_fd;
+    ctx->out_is_tty = isatty(out_fd);
+    ctx->stdin_generation = 1;
+    ctx->trace_ring.fd = -1;
+    ctx->history.fd = -1;
+    return ctx;
+}
 
-    return status;
+// A subshell of ctx on in_fd and out_fd (which stay the caller's): it
+// starts with ctx's variables, directory, options and history, and
+// nothing done in it reaches ctx. This is what lets the builtins of a
+// pipeline or "$(...)" run without a forked process to contain them.
+static ShellContext *shell_subshell(ShellContext *ctx, int in_fd, int out_fd) {
+    ShellContext *sub = (ShellContext *)calloc(1, sizeof(ShellContext));
+    if (!sub) {
+        return NULL;
+    }
+    sub->cwd_fd = fcntl(ctx->cwd_fd, F_DUPFD_CLOEXEC, 0);
+    if (sub->cwd_fd == -1) {
+        free(sub);
+        return NULL;
+    }
+    sub->cwd = strdup(ctx->cwd);
+    sub->variables = (ShellVar *)malloc((ctx->var_count + 1) * sizeof(ShellVar));
+    for (int i = 0; i < ctx->var_count; i++) {
+        sub->variables[i].name = strdup(ctx->variables[i].name);
+        sub->variables[i].value = strdup(ctx->variables[i].value);
+        sub->variables[i].exported = ctx->variables[i].exported;
+    }
+    sub->var_count = ctx->var_count;
+    sub->fds[STDIN_FILENO] = in_fd;
+    sub->fds[STDOUT_FILENO] = out_fd;
+    sub->fds[STDERR_FILENO] = ctx->fds[STDERR_FILENO];
+    // Still reading the script's own stdin: share its stream
+    if (in_fd == ctx->fds[STDIN_FILENO] && ctx->stdin_redirect_depth == 0) {
+        sub->script_input = ctx->script_input;
+    }
+    sub->out_is_tty = isatty(out_fd);
+    sub->last_status = ctx->last_status;
+    sub->command_timeout_ms = ctx->command_timeout_ms;
+    sub->xtrace = ctx->xtrace;
+    sub->stdin_generation = 1;
+    // Traced into a ring of its own on the same file; seq stays shared
+    sub->trace_ring.fd = -1;
+    if (ctx->trace_ring.fd != -1) {
+        sub->trace_ring.fd = fcntl(ctx->trace_ring.fd, F_DUPFD_CLOEXEC, 0);
+        sub->trace_shared = ctx->trace_shared;
+        sub->trace_exec_stamp = ctx->trace_exec_stamp;
+        sub->script_parse_start = ctx->script_parse_start;
+        sub->script_parse_end = ctx->script_parse_end;
+    }
+    sub->history = ctx->history;
+    sub->history.enabled = 0;
+    sub->subshell = 1;
+    return sub;
 }
 
-// Built-in commands
-// Helper function to handle redirections and modify args array
-int handle_redirections(char **args, int *arg_count) {
-    int i = 0;
-    while (args[i] != NULL) {
-        if (strcmp(args[i], "<") == 0) {
-            if (args[i+1] == NULL) {
-                printf("syntax error near unexpected token `newline'\n");
-                return -1;
-            }
-            char *input_file = args[i+1];
-            int stdin_fd = open(input_file, O_RDONLY);
-            if (stdin_fd == -1) {
-                fprintf(stderr, "cannot access %s: No such file or directory\n", input_file);
-                return -1;
-            }
-            if (dup2(stdin_fd, STDIN_FILENO) == -1) {
-                perror("dup2 stdin");
-                return -1;
-            }
-            close(stdin_fd);
-            // Remove redirection tokens from args
-            for (int j = i; args[j] != NULL; j++) {
-                args[j] = args[j+2];
-            }
-            (*arg_count) -= 2;
-            continue;
-        }
-        else if (strcmp(args[i], ">") == 0) {
-            if (args[i+1] == NULL) {
-                printf("syntax error near unexpected token `newline'\n");
-                return -1;
-            }
-            char *output_file = args[i+1];
-            int stdout_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (stdout_fd == -1) {
-                fprintf(stderr, "%s: Permission denied\n", output_file);
-                return -1;
-            }
-            if (dup2(stdout_fd, STDOUT_FILENO) == -1) {
-                perror("dup2 stdout");
-                return -1;
-            }
-            close(stdout_fd);
-            // Remove redirection tokens from args
-            for (int j = i; args[j] != NULL; j++) {
-                args[j] = args[j+2];
-            }
-            (*arg_count) -= 2;
-            continue;
-        }
-        else if (strcmp(args[i], "2>") == 0) {
-            if (args[i+1] == NULL) {
-                printf("syntax error near unexpected token `newline'\n");
-                return -1;
-            }
-            char *error_file = args[i+1];
-            int stderr_fd = open(error_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (stderr_fd == -1) {
-                perror("open error file");
-                return -1;
-            }
-            if (dup2(stderr_fd, STDERR_FILENO) == -1) {
-                perror("dup2 stderr");
-                return -1;
+void shell_destroy(ShellContext *ctx) {
+    shell_flush(ctx);
+    trace_close(ctx);
+    read_buffer_sync(ctx);
+    free(ctx->read_buffer.data);
+    // A subshell only borrows the page
+    if (ctx->trace_shared && !ctx->subshell) {
+        munmap(ctx->trace_shared, sizeof(TraceShared));
+    }
+    for (int i = 0; i < ctx->var_count; i++) {
+        free(ctx->variables[i].name);
+        free(ctx->variables[i].value);
+    }
+    free(ctx->variables);
+    if (!ctx->subshell) {
+        history_close(ctx);
+    }
+    close(ctx->cwd_fd);
+    free(ctx->cwd);
+    free(ctx->out.data);
+    free(ctx->pending.data);
+    free(ctx);
+}
+
+// Carry the scan of the pending lines over the one just added. Returns 1
+// once no construct is left open, so parse_script() runs once per
+// command, not once per line; a line inside an open quote or "$(" is
+// lexed again, from where the scan stopped, with the next one. Errors
+// within an open construct show when it closes.
+static int pending_closed(ShellContext *ctx) {
+    PendingScan *scan = &ctx->pending_scan;
+    int count = 0;
+    int incomplete = 0;
+    Token *tokens = tokenize(ctx->pending.data + scan->lexed, &count, &incomplete);
+    if (incomplete) {
+        free_tokens(tokens, count);
+        return 0;
+    }
+    scan->lexed = ctx->pending.len;
+    for (int i = 0; i < count; i++) {
+        const char *word = tokens[i].text;
+        switch (tokens[i].type) {
+        case TOK_WORD:
+            scan->continued = 0;
+            if (scan->redirect) {
+                scan->redirect = 0;
+            } else if (scan->state == SCAN_COMMAND &&
+                       (!strcmp(word, "if") || !strcmp(word, "while") || !strcmp(word, "until"))) {
+                scan->depth++;
+            } else if (scan->state == SCAN_COMMAND && !strcmp(word, "for")) {
+                scan->depth++;
+                scan->state = SCAN_ARGS;
+            } else if (scan->state != SCAN_ARGS &&
+                       (!strcmp(word, "then") || !strcmp(word, "elif") ||
+                        !strcmp(word, "else") || !strcmp(word, "do"))) {
+                scan->state = SCAN_COMMAND;
+            } else if (scan->state != SCAN_ARGS && (!strcmp(word, "fi") || !strcmp(word, "done"))) {
+                scan->depth--;
+                scan->state = SCAN_CLOSED;
+            } else {
+                scan->state = SCAN_ARGS;
             }
-            close(stderr_fd);
-            // Remove redirection tokens from args
-            for (int j = i; args[j] != NULL; j++) {
-                args[j] = args[j+2];
+            break;
+        case TOK_REDIRECT:
+            scan->continued = 0;
+            scan->redirect = 1;
+            if (scan->state == SCAN_COMMAND) {
+                scan->state = SCAN_ARGS;
             }
-            (*arg_count) -= 2;
-            continue;
+            break;
+        case TOK_AND:
+        case TOK_OR:
+        case TOK_PIPE:
+            scan->continued = 1;
+            scan->redirect = 0;
+            scan->state = SCAN_COMMAND;
+            break;
+        case TOK_SEMI:
+            scan->continued = 0;
+            // fall through
+        case TOK_NEWLINE:
+            scan->redirect = 0;
+            scan->state = SCAN_COMMAND;
+            break;
+        case TOK_EOF:
+            break;
         }
-        i++;
     }
-    return 0;
+    free_tokens(tokens, count);
+    return scan->depth <= 0 && !scan->continued;
 }
 
-// Modified built-in functions to use redirections
-int echo(char **args, int arg_count) {
-    int error = handle_redirections(args, &arg_count);
-    if (error != 0) {
-        return -1;
+// Feed one line to the session. Lines are collected until they form
+// complete commands, which then run. Returns the status of the last
+// command; shell_incomplete() says whether more lines are expected.
+// With history on, "!" references are expanded first and every complete
+// command is recorded.
+int shell_eval(ShellContext *ctx, const char *line) {
+    char *expanded = NULL;
+    if (ctx->history.enabled && strchr(line, '!')) {
+        int changed = 0;
+        expanded = history_expand(ctx, line, &changed);
+        if (!expanded) {
+            // Unknown event: the line is dropped, as a whole
+            ctx->pending.len = 0;
+            memset(&ctx->pending_scan, 0, sizeof(PendingScan));
+            ctx->last_status = 1;
+            shell_flush(ctx);
+            return ctx->last_status;
+        }
+        if (changed) {
+            shell_printf(ctx, STDOUT_FILENO, "%s\n", expanded);
+        }
+        line = expanded;
     }
-    for (int i = 1; i < arg_count; i++) {
-        printf("%s", args[i]);
-        if (i < arg_count - 1) {
-            printf(" ");
+    if (ctx->pending.len > 0) {
+        sb_append(&ctx->pending, "\n", 1);
+    }
+    sb_append(&ctx->pending, line, strlen(line));
+    free(expanded);
+
+    if (!pending_closed(ctx)) {
+        return ctx->last_status;
+    }
+    Node *tree = NULL;
+    int result = parse_script(ctx, ctx->pending.data, &tree);
+    if (result == PARSE_INCOMPLETE) {
+        return ctx->last_status;
+    }
+    if (ctx->history.enabled) {
+        history_add(ctx, ctx->pending.data);
+    }
+    ctx->pending.len = 0;
+    memset(&ctx->pending_scan, 0, sizeof(PendingScan));
+    if (result == PARSE_ERROR) {
+        ctx->last_status = 2;
+    } else if (tree) {
+        ctx->last_status = execute_node(ctx, tree);
+        free_node(tree);
+    }
+    shell_flush(ctx);
+    return ctx->last_status;
+}
+
+int shell_incomplete(ShellContext *ctx) {
+    return ctx->pending.len > 0;
+}
+
+// True once the session ran exit
+int shell_exited(ShellContext *ctx) {
+    return ctx->exit_requested;
+}
+
+// Session output. fds[1] is buffered (per line on a terminal); anything
+// for fds[2] goes out at once, after the pending stdout so the two stay
+// in order.
+void shell_flush(ShellContext *ctx) {
+    if (ctx->out.len > 0) {
+        if (write_all(ctx->fds[STDOUT_FILENO], ctx->out.data, ctx->out.len) == -1 &&
+            errno == EPIPE) {
+            // Only seen with SIGPIPE blocked, i.e. in a pipeline stage on
+            // a thread: stop it as SIGPIPE would have stopped a process
+            ctx->broken_pipe = 1;
+            ctx->exit_requested = 1;
         }
+        ctx->out.len = 0;
     }
-    printf("\n");
-    return 0;
 }
 
-int pwd() {
-    char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd))) {
-        printf("%s\n", cwd);
-    } else {
-        perror("pwd");
+void shell_write(ShellContext *ctx, int fd, const char *data, size_t len) {
+    if (fd != STDOUT_FILENO) {
+        shell_flush(ctx);
+        write_all(ctx->fds[fd], data, len);
+        return;
+    }
+    sb_append(&ctx->out, data, len);
+    if (ctx->out.len >= OUTPUT_BUFFER_SIZE ||
+        (ctx->out_is_tty && memchr(data, '\n', len))) {
+        shell_flush(ctx);
     }
-    return 0;
 }
 
-int cd(char **args, int arg_count) {
-    int error = handle_redirections(args, &arg_count);
-    if (error != 0) {
-        return -1;
+void shell_printf(ShellContext *ctx, int fd, const char *format, ...) {
+    char small[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(small, sizeof(small), format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return;
     }
-    if (arg_count < 2) {
-        fprintf(stderr, "cd: missing argument\n");
-        return -1;
+    if ((size_t)len < sizeof(small)) {
+        shell_write(ctx, fd, small, len);
+        return;
     }
-    if (chdir(args[1]) != 0) {
-        printf("cd: %s: No such file or directory\n", args[1]);
-        return -1;
+    char *text = (char *)malloc(len + 1);
+    if (!text) {
+        return;
     }
-    return 0;
+    va_start(ap, format);
+    vsnprintf(text, len + 1, format, ap);
+    va_end(ap);
+    shell_write(ctx, fd, text, len);
+    free(text);
 }
 
-// Simplified execute_external function
-int execute_external(char **args, int arg_count) {
-    pid_t pid = fork();
-    if (pid == -1) {
-        perror("fork");
-        return -1;
+// perror() for the session's stderr
+static void shell_perror(ShellContext *ctx, const char *what) {
+    shell_printf(ctx, STDERR_FILENO, "%s: %s\n", what, strerror(errno));
+}
+
+static int execute_builtin_or_external(ShellContext *ctx, char **args, int arg_count);
+
+// An unquoted word that expands to nothing ($UNSET, a lone line
+// continuation) is dropped instead of becoming an empty argument
+static int expands_to_nothing(const char *word, const char *value) {
+    return value[0] == '\0' && !strpbrk(word, "'\"");
+}
+
+// Run one simple command from the tree. The tree keeps its words intact;
+// each run works on a fresh expansion so loop bodies can be executed repeatedly.
+int execute_command(ShellContext *ctx, Node *node) {
+    char **words = node->words;
+    int word_count = node->word_count;
+    int status = 0;
+
+    TraceTimes times;
+    int traced = ctx->trace_ring.fd != -1;
+    if (traced) {
+        memset(&times, 0, sizeof(times));
+        times.parse_start = ctx->script_parse_start;
+        times.parse_end = ctx->script_parse_end;
+        times.expand = monotonic_ns();
+        ctx->current_trace = &times;
     }
 
-    if (pid == 0) {
-        int error = handle_redirections(args, &arg_count);
-        if (error != 0) {
-            exit(EXIT_FAILURE);
-        }
+    // A command left with no words (an assignment, or a "$(...)" that
+    // expanded to nothing) has the status of its last substitution
+    int substitutions = ctx->substitutions;
 
-        // Exported vars only
-        for (int i = 0; i < var_count; i++) {
-            if (variables[i].exported) {
-                setenv(variables[i].name, variables[i].value, 1);
+    // Handle assignment (x=5); quotes are only allowed in the value
+    char *eq_ptr = word_count == 1 ? strchr(words[0], '=') : NULL;
+    if (eq_ptr && words[0][0] != '=' && node->redir_count == 0 &&
+        strcspn(words[0], "'\"\\$") > (size_t)(eq_ptr - words[0])) {
+        if (eq_ptr[1] == '\0') {
+            shell_printf(ctx, STDOUT_FILENO, "Invalid command\n");
+            ctx->current_trace = NULL;
+            return 0;
+        }
+        char *name = strndup(words[0], eq_ptr - words[0]);
+        char *value = expand_word(ctx, eq_ptr + 1);
+        add_or_update_var(ctx, name, value, 0);
+        if (ctx->xtrace || ctx->current_trace) {
+            char *assignment = (char *)malloc(strlen(name) + strlen(value) + 2);
+            sprintf(assignment, "%s=%s", name, value);
+            if (ctx->xtrace) {
+                xtrace_print(ctx, &assignment, 1);
+            }
+            if (ctx->current_trace) {
+                times.end = monotonic_ns();
+                trace_record(ctx, &assignment, 1, 0, &times);
+                ctx->current_trace = NULL;
             }
+            free(assignment);
         }
+        free(name);
+        free(value);
+        return ctx->substitutions != substitutions ? ctx->last_status : 0;
+    }
 
-        execvp(args[0], args);
-        printf("%s: command not found\n", args[0]);
+    int arg_count = 0;
+    char **args = (char **)malloc((word_count + 1) * sizeof(char *));
+    if (!args) {
+        perror("malloc");
         exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < word_count; i++) {
+        char *arg = expand_word(ctx, words[i]);
+        if (expands_to_nothing(words[i], arg)) {
+            free(arg);
+            continue;
+        }
+        args[arg_count++] = arg;
+    }
+    args[arg_count] = NULL;
+    if (ctx->xtrace) {
+        xtrace_print(ctx, args, arg_count);
+    }
+
+    int saved[3];
+    if (apply_redirections(ctx, node->redirs, node->redir_count, saved) != 0) {
+        status = 1;
+    } else if (arg_count == 0) {
+        status = ctx->substitutions != substitutions ? ctx->last_status : 0;
+        restore_redirections(ctx, saved);
     } else {
-        int status;
-        waitpid(pid, &status, 0);
-        return WEXITSTATUS(status);
+        status = execute_builtin_or_external(ctx, args, arg_count);
+        restore_redirections(ctx, saved);
+    }
+
+    if (ctx->current_trace) {
+        times.end = monotonic_ns();
+        trace_record(ctx, args, arg_count, status, &times);
+        ctx->current_trace = NULL;
+    }
+    if (traced) {
+        free(times.redirections.data);
     }
+    free_args(args, arg_count);
+    return status;
 }
 
-// Variable system
-void add_or_update_var(const char *name, const char *value, int exported) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            free(variables[i].value);
-            variables[i].value = strdup(value);
-            if (exported) variables[i].exported = 1;
-            return;
+// Dispatch expanded args to a builtin or an external command
+static int execute_builtin_or_external(ShellContext *ctx, char **args, int arg_count) {
+    int status = 0;
+
+    if (strcmp(args[0], "exit") == 0) {
+        if (!ctx->subshell) {
+            shell_printf(ctx, STDOUT_FILENO, "Good Bye\n");
+        }
+        status = arg_count > 1 ? atoi(args[1]) : ctx->last_status;
+        ctx->exit_requested = 1;
+    } else if (strcmp(args[0], "echo") == 0) {
+        status = echo(ctx, args, arg_count);
+
+    } else if (strcmp(args[0], "pwd") == 0) {
+        status = pwd(ctx);
+
+    } else if (strcmp(args[0], "cd") == 0) {
+        status = cd(ctx, args, arg_count);
+    } else if (strcmp(args[0], "export") == 0) {
+        if (arg_count < 2) {
+            shell_printf(ctx, STDOUT_FILENO, "export: missing argument\n");
+        } else {
+            export_var(ctx, args[1]);
+        }
+        status = 0;
+    } else if (strcmp(args[0], "set") == 0) {
+        status = set_builtin(ctx, args, arg_count);
+    } else if (strcmp(args[0], "read") == 0) {
+        status = read_builtin(ctx, args, arg_count);
+    } else if (strcmp(args[0], "cat") == 0) {
+        status = cat_builtin(ctx, args, arg_count);
+    } else if (strcmp(args[0], "timeout") == 0) {
+        status = timeout_builtin(ctx, args, arg_count);
+    } else if (strcmp(args[0], "history") == 0) {
+        status = history_builtin(ctx, args, arg_count);
+    } else if (strcmp(args[0], "break") == 0 || strcmp(args[0], "continue") == 0) {
+        int levels = arg_count > 1 ? atoi(args[1]) : 1;
+        if (levels < 1) {
+            levels = 1;
         }
+        // Outside of a loop these are no-ops, as in other shells
+        if (levels > ctx->loop_depth) {
+            levels = ctx->loop_depth;
+        }
+        if (args[0][0] == 'b') {
+            ctx->loop_break = levels;
+        } else {
+            ctx->loop_continue = levels;
+        }
+        status = 0;
+    } else {
+        status = execute_external(ctx, args);
     }
+    return status;
+}
 
-    variables = (ShellVar *)realloc(variables, sizeof(ShellVar) * (var_count + 1));
-    variables[var_count].name = strdup(name);
-    variables[var_count].value = strdup(value);
-    variables[var_count].exported = exported;
-    var_count++;
+// True while a break, continue or exit is unwinding the tree
+static int interrupted(ShellContext *ctx) {
+    return ctx->exit_requested || ctx->loop_break || ctx->loop_continue;
 }
 
-const char *get_var_value(const char *name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            return variables[i].value;
-        }
+// Consume a pending break/continue at the end of one loop iteration.
+// Returns 1 when the enclosing loop must stop.
+static int loop_should_stop(ShellContext *ctx) {
+    if (ctx->loop_break) {
+        ctx->loop_break--;
+        return 1;
     }
-    return NULL;
+    if (ctx->loop_continue) {
+        ctx->loop_continue--;
+        return ctx->loop_continue > 0;
+    }
+    return ctx->exit_requested;
 }
 
-void export_var(const char *name) {
-    for (int i = 0; i < var_count; i++) {
-        if (strcmp(variables[i].name, name) == 0) {
-            variables[i].exported = 1;
-            setenv(variables[i].name, variables[i].value, 1);
-            return;
-        }
+static int execute_compound(ShellContext *ctx, Node *node);
+static int execute_pipeline(ShellContext *ctx, Node *node);
+
+int execute_node(ShellContext *ctx, Node *node) {
+    if (node->type == NODE_COMMAND || node->redir_count == 0) {
+        return execute_compound(ctx, node);
     }
-    printf("export: %s: not found\n", name);
+
+    // Redirections on a whole if/for/while apply to everything inside it
+    int saved[3];
+    if (apply_redirections(ctx, node->redirs, node->redir_count, saved) != 0) {
+        return 1;
+    }
+    int status = execute_compound(ctx, node);
+    restore_redirections(ctx, saved);
+    return status;
 }
 
-void substitute_variables(char **args, int arg_count) {
-    for (int i = 0; i < arg_count; i++) {
-        char *src = args[i];
-        char *result = (char*)malloc(strlen(src) * 2 + 1); 
-        if (!result) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
+static int execute_compound(ShellContext *ctx, Node *node) {
+    int status = 0;
+
+    switch (node->type) {
+    case NODE_COMMAND:
+        status = execute_command(ctx, node);
+        break;
+    case NODE_LIST:
+        for (int i = 0; i < node->child_count && !interrupted(ctx); i++) {
+            status = execute_node(ctx, node->children[i]);
+            ctx->last_status = status;
+        }
+        break;
+    case NODE_AND:
+    case NODE_OR:
+        status = execute_node(ctx, node->cond);
+        ctx->last_status = status;
+        if (!interrupted(ctx) && ((status == 0) == (node->type == NODE_AND))) {
+            status = execute_node(ctx, node->body);
+        }
+        break;
+    case NODE_IF:
+        status = execute_node(ctx, node->cond);
+        ctx->last_status = status;
+        if (interrupted(ctx)) {
+            break;
+        }
+        if (status == 0) {
+            status = execute_node(ctx, node->body);
+        } else if (node->alt) {
+            status = execute_node(ctx, node->alt);
+        } else {
+            status = 0;
+        }
+        break;
+    case NODE_FOR:
+        ctx->loop_depth++;
+        for (int i = 0; i < node->word_count; i++) {
+            char *value = expand_word(ctx, node->words[i]);
+            if (expands_to_nothing(node->words[i], value)) {
+                free(value);
+                continue;
+            }
+            add_or_update_var(ctx, node->name, value, 0);
+            free(value);
+            if (node->body) {
+                status = execute_node(ctx, node->body);
+                ctx->last_status = status;
+            }
+            if (interrupted(ctx) && loop_should_stop(ctx)) {
+                break;
+            }
+        }
+        ctx->loop_depth--;
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        ctx->loop_depth++;
+        while (1) {
+            int cond = execute_node(ctx, node->cond);
+            ctx->last_status = cond;
+            if (interrupted(ctx)) {
+                break;
+            }
+            if ((cond == 0) != (node->type == NODE_WHILE)) {
+                break;
+            }
+            if (node->body) {
+                status = execute_node(ctx, node->body);
+                ctx->last_status = status;
+            }
+            if (interrupted(ctx) && loop_should_stop(ctx)) {
+                break;
+            }
         }
+        ctx->loop_depth--;
+        break;
+    case NODE_PIPELINE:
+        status = execute_pipeline(ctx, node);
+        break;
+    }
+    return status;
+}
 
-        int ri = 0;
-        for (int si = 0; src[si];) {
-            if (src[si] == '$') {
-                si++;
-                char var_name[256];
-                int vi = 0;
+// Builtins that need no process of their own: a pipeline stage or
+// "$(...)" made only of these runs on a thread of the shell
+static const char *const INPROCESS_BUILTINS[] = {
+    "echo", "pwd", "cd", "export", "set", "read", "cat", "history",
+    "exit", "break", "continue", NULL
+};
 
-                // Read variable name (letters, digits, underscores)
-                while (src[si] && (isalnum(src[si]) || src[si] == '_')) {
-                    var_name[vi++] = src[si++];
-                }
-                var_name[vi] = '\0';
+// A word that may expand to an option ("-n", "$flags", "\-n", ...)
+static int may_be_option(const char *word) {
+    if (word[0] == '-') {
+        return word[1] != '\0';
+    }
+    return word[0] != '\0' && strchr("$\"'\\`", word[0]) != NULL;
+}
 
-                const char *val = get_var_value(var_name);
-                if (val) {
-                    for (int k = 0; val[k]; k++) {
-                        result[ri++] = val[k];
-                    }
+// True when running node certainly forks nothing. The words are not
+// expanded yet, so anything whose meaning expansion decides counts as
+// forking: a command name that is not a plain builtin name, a command
+// substitution anywhere, and a cat argument that may be an option (cat
+// then runs the external one). Either way node runs correctly in a
+// subshell context; this only decides whether a thread or a process
+// hosts it, and a thread must never fork.
+static int builtin_only(Node *node) {
+    if (!node) {
+        return 1;
+    }
+    for (int i = 0; i < node->word_count; i++) {
+        if (strstr(node->words[i], "$(") || strchr(node->words[i], '`')) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < node->redir_count; i++) {
+        if (strstr(node->redirs[i].target, "$(") || strchr(node->redirs[i].target, '`')) {
+            return 0;
+        }
+    }
+    if (node->type == NODE_COMMAND) {
+        if (node->word_count == 0) {
+            return 1;
+        }
+        const char *name = node->words[0];
+        if (node->word_count == 1 && strchr(name, '=') && name[0] != '=') {
+            return 1;
+        }
+        if (strcmp(name, "cat") == 0) {
+            for (int i = 1; i < node->word_count; i++) {
+                if (may_be_option(node->words[i])) {
+                    return 0;
                 }
-                // If variable doesn't exist, skip (leave blank)
-            } else {
-                result[ri++] = src[si++];
             }
         }
+        for (int i = 0; INPROCESS_BUILTINS[i]; i++) {
+            if (strcmp(name, INPROCESS_BUILTINS[i]) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        if (!builtin_only(node->children[i])) {
+            return 0;
+        }
+    }
+    return builtin_only(node->cond) && builtin_only(node->body) && builtin_only(node->alt);
+}
 
-        result[ri] = '\0';
-        free(args[i]);
-        args[i] = strdup(result);
-        free(result);
+// A pipeline stage running in-process: a subshell context, executed on a
+// thread so that it runs alongside the other stages exactly as a forked
+// stage would
+typedef struct {
+    Node *node;
+    int in_process;     // builtin_only(node): hosted by a thread
+    int in_fd;          // pipe ends the stage owns, or -1
+    int out_fd;
+    ShellContext *ctx;
+    pthread_t thread;
+    pid_t pid;          // forked stage instead, else 0
+    int status;
+} PipelineStage;
+
+static void *run_stage(void *arg) {
+    PipelineStage *stage = (PipelineStage *)arg;
+    // Writing to a pipe whose reader is gone has to fail with EPIPE here
+    // rather than raise SIGPIPE, which would end the whole process
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    stage->status = execute_node(stage->ctx, stage->node);
+    shell_flush(stage->ctx);
+    if (stage->ctx->broken_pipe) {
+        stage->status = 128 + SIGPIPE;
     }
+    // The neighbours see EOF (or EPIPE) as soon as the stage is done
+    if (stage->in_fd != -1) {
+        close(stage->in_fd);
+    }
+    if (stage->out_fd != -1) {
+        close(stage->out_fd);
+    }
+    return NULL;
 }
 
-// Command parsing and execution
-char **parse_command(char *input, int *arg_count) {
-    char **args = (char**)malloc(MAX_ARGS * sizeof(char *));
-    if (!args) {
+// cmd | cmd | ... Builtin-only stages run on threads; only stages that
+// run an external command are forked, and a stage that is a single
+// external command is exec'ed straight from that fork. The status is
+// that of the last stage; as in other shells, no stage changes the session.
+//
+// All forks happen before the first stage thread starts. Until then only
+// this thread opens or closes pipe ends, and an end it has closed is set
+// to -1 in pipes[], so a forked stage knows exactly which of the numbers
+// left are still the pipeline's ends (and not some reused fd).
+static int execute_pipeline(ShellContext *ctx, Node *node) {
+    int n = node->child_count;
+    // pipes[2i] is read by stage i + 1, pipes[2i + 1] written by stage i
+    int *pipes = (int *)malloc(2 * n * sizeof(int));
+    PipelineStage *stages = (PipelineStage *)calloc(n, sizeof(PipelineStage));
+    if (!pipes || !stages) {
         perror("malloc");
         exit(EXIT_FAILURE);
     }
-
-    *arg_count = 0;
-    char *token = strtok(input, " ");
-    while (token && *arg_count < MAX_ARGS - 1) {
-        args[*arg_count] = strdup(token);
-        if (!args[*arg_count]) {
-            perror("strdup");
-            exit(EXIT_FAILURE);
+    // Close-on-exec from the start: a stage thread may be forking meanwhile
+    for (int i = 0; i < n - 1; i++) {
+        if (syscall(SYS_pipe2, &pipes[2 * i], O_CLOEXEC) == -1) {
+            shell_perror(ctx, "pipe");
+            for (int fd = 0; fd < 2 * i; fd++) {
+                close(pipes[fd]);
+            }
+            free(pipes);
+            free(stages);
+            return 1;
         }
-        (*arg_count)++;
-        token = strtok(NULL, " ");
     }
-    args[*arg_count] = NULL;
-    return args;
-}
-
-void free_args(char **args, int arg_count) {
-    for (int i = 0; i < arg_count; i++) {
-        free(args[i]);
-    }
-    free(args);
-}
 
+    shell_flush(ctx);
+    read_buffer_sync(ctx);
+    // Forked shells trace on their own; what is queued here goes first
+    trace_flush(ctx);
+    for (int i = 0; i < n; i++) {
+        PipelineStage *stage = &stages[i];
+        stage->node = node->children[i];
+        stage->in_process = builtin_only(stage->node);
+        if (stage->in_process) {
+            continue;
+        }
+        int in_fd = i > 0 ? pipes[2 * i - 2] : ctx->fds[STDIN_FILENO];
+        int out_fd = i < n - 1 ? pipes[2 * i + 1] : ctx->fds[STDOUT_FILENO];
+
+        stage->pid = fork();
+        if (stage->pid == -1) {
+            shell_perror(ctx, "fork");
+            stage->pid = 0;
+            stage->status = 1;
+        } else if (stage->pid == 0) {
+            // Holding another stage's pipe end would keep its EOF from coming
+            for (int fd = 0; fd < 2 * (n - 1); fd++) {
+                if (pipes[fd] != -1 && pipes[fd] != in_fd && pipes[fd] != out_fd) {
+                    close(pipes[fd]);
+                }
+            }
+            ctx->fds[STDIN_FILENO] = in_fd;
+            ctx->fds[STDOUT_FILENO] = out_fd;
+            ctx->out_is_tty = isatty(out_fd);
+            if (i > 0) {
+                ctx->script_input = NULL;
+                ctx->stdin_generation++;
+            }
+            trace_forked(ctx);
+            ctx->subshell = 1;
+            // A traced command is forked once more, so that its event
+            // can be recorded when it ends
+            ctx->exec_in_place = stage->node->type == NODE_COMMAND && ctx->trace_ring.fd == -1;
+            int status = execute_node(ctx, stage->node);
+            shell_flush(ctx);
+            trace_flush(ctx);
+            _exit(status & 0xff);
+        }
+        if (i > 0) {
+            close(pipes[2 * i - 2]);
+            pipes[2 * i - 2] = -1;
+        }
+        if (i < n - 1) {
+            close(pipes[2 * i + 1]);
+            pipes[2 * i + 1] = -1;
+        }
+    }
+
+    // The rest run on threads, each closing its own pipe ends when done
+    for (int i = 0; i < n; i++) {
+        PipelineStage *stage = &stages[i];
+        if (!stage->in_process) {
+            continue;
+        }
+        stage->in_fd = i > 0 ? pipes[2 * i - 2] : -1;
+        stage->out_fd = i < n - 1 ? pipes[2 * i + 1] : -1;
+        int in_fd = i > 0 ? stage->in_fd : ctx->fds[STDIN_FILENO];
+        int out_fd = i < n - 1 ? stage->out_fd : ctx->fds[STDOUT_FILENO];
+        stage->ctx = shell_subshell(ctx, in_fd, out_fd);
+        int error = stage->ctx ? pthread_create(&stage->thread, NULL, run_stage, stage) : errno;
+        if (error == 0) {
+            continue;
+        }
+        shell_printf(ctx, STDERR_FILENO, "pipeline: %s\n", strerror(error));
+        if (stage->ctx) {
+            shell_destroy(stage->ctx);
+            stage->ctx = NULL;
+        }
+        stage->status = 1;
+        if (stage->in_fd != -1) {
+            close(stage->in_fd);
+        }
+        if (stage->out_fd != -1) {
+            close(stage->out_fd);
+        }
+    }
+
+    int status = 0;
+    for (int i = 0; i < n; i++) {
+        PipelineStage *stage = &stages[i];
+        if (stage->ctx) {
+            pthread_join(stage->thread, NULL);
+            shell_destroy(stage->ctx);
+        } else if (stage->pid) {
+            stage->status = wait_for_child(ctx, stage->pid, 0, 0);
+        }
+        status = stage->status;
+    }
+    free(pipes);
+    free(stages);
+    return status;
+}
+
+// Built-in commands
+// Point the session's fds 0-2 at the redirection targets for the duration
+// of a command. The previous fds are parked in saved[] for
+// restore_redirections(); the process's own fds are never touched.
+int apply_redirections(ShellContext *ctx, Redirect *redirs, int redir_count, int saved[3]) {
+    saved[0] = saved[1] = saved[2] = -1;
+    if (redir_count == 0) {
+        return 0;
+    }
+    // Output already buffered belongs to the old stdout
+    shell_flush(ctx);
+
+    for (int i = 0; i < redir_count; i++) {
+        char *target = expand_word(ctx, redirs[i].target);
+        int fd = openat(ctx->cwd_fd, target, redirs[i].flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            if (redirs[i].fd == STDIN_FILENO) {
+                shell_printf(ctx, STDERR_FILENO, "cannot access %s: No such file or directory\n", target);
+            } else if (redirs[i].fd == STDOUT_FILENO) {
+                shell_printf(ctx, STDERR_FILENO, "%s: Permission denied\n", target);
+            } else {
+                shell_perror(ctx, "open error file");
+            }
+            free(target);
+            restore_redirections(ctx, saved);
+            if (ctx->current_trace) {
+                ctx->current_trace->redirections.len = 0;
+            }
+            return -1;
+        }
+        if (ctx->current_trace) {
+            trace_redirection(ctx->current_trace, redirs[i].fd, redirs[i].flags, target);
+        }
+        free(target);
+
+        int target_fd = redirs[i].fd;
+        if (target_fd == STDIN_FILENO) {
+            read_buffer_sync(ctx);
+            ctx->stdin_generation++;
+        }
+        if (saved[target_fd] == -1) {
+            saved[target_fd] = ctx->fds[target_fd];
+            if (target_fd == STDIN_FILENO) {
+                ctx->stdin_redirect_depth++;
+            }
+        } else {
+            // Replaces an earlier redirection of the same fd ("> a > b")
+            close(ctx->fds[target_fd]);
+        }
+        ctx->fds[target_fd] = fd;
+        if (target_fd == STDOUT_FILENO) {
+            ctx->out_is_tty = isatty(fd);
+        }
+    }
+    return 0;
+}
+
+void restore_redirections(ShellContext *ctx, int saved[3]) {
+    if (saved[STDOUT_FILENO] != -1) {
+        shell_flush(ctx);
+    }
+    if (saved[STDIN_FILENO] != -1) {
+        read_buffer_sync(ctx);
+        ctx->stdin_generation++;
+        ctx->stdin_redirect_depth--;
+    }
+    for (int fd = 0; fd < 3; fd++) {
+        if (saved[fd] != -1) {
+            close(ctx->fds[fd]);
+            ctx->fds[fd] = saved[fd];
+            saved[fd] = -1;
+        }
+    }
+    ctx->out_is_tty = isatty(ctx->fds[STDOUT_FILENO]);
+}
+
+// Built-in functions (redirections are already in place)
+int echo(ShellContext *ctx, char **args, int arg_count) {
+    for (int i = 1; i < arg_count; i++) {
+        shell_write(ctx, STDOUT_FILENO, args[i], strlen(args[i]));
+        if (i < arg_count - 1) {
+            shell_write(ctx, STDOUT_FILENO, " ", 1);
+        }
+    }
+    shell_write(ctx, STDOUT_FILENO, "\n", 1);
+    return 0;
+}
+
+int pwd(ShellContext *ctx) {
+    shell_printf(ctx, STDOUT_FILENO, "%s\n", ctx->cwd);
+    return 0;
+}
+
+// Resolve path against the logical directory dir, folding "." and ".."
+static char *join_path(const char *dir, const char *path) {
+    StrBuf sb = {NULL, 0, 0};
+    sb_append(&sb, "", 0);
+    if (path[0] != '/') {
+        sb_append(&sb, dir, strlen(dir));
+    }
+    const char *p = path;
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        size_t len = strcspn(p, "/");
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            char *slash = strrchr(sb.data, '/');
+            sb.len = slash ? (size_t)(slash - sb.data) : 0;
+            sb.data[sb.len] = '\0';
+        } else if (len > 0 && !(len == 1 && p[0] == '.')) {
+            sb_append(&sb, "/", 1);
+            sb_append(&sb, p, len);
+        }
+        p += len;
+    }
+    if (sb.len == 0) {
+        sb_append(&sb, "/", 1);
+    }
+    return sb.data;
+}
+
+// The physical path of directory fd, as getcwd() would give it after an
+// fchdir(fd). NULL when /proc cannot tell.
+static char *fd_path(int fd) {
+    char link[64];
+    char target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len <= 0 || target[0] != '/') {
+        return NULL;
+    }
+    target[len] = '\0';
+    return strdup(target);
+}
+
+// The session's directory is an open fd; nothing calls chdir(). The path
+// kept for pwd is that of the directory actually opened (symlinks
+// resolved), so that it always names the fd.
+int cd(ShellContext *ctx, char **args, int arg_count) {
+    if (arg_count < 2) {
+        shell_printf(ctx, STDERR_FILENO, "cd: missing argument\n");
+        return -1;
+    }
+    int fd = openat(ctx->cwd_fd, args[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        shell_printf(ctx, STDOUT_FILENO, "cd: %s: No such file or directory\n", args[1]);
+        return -1;
+    }
+    close(ctx->cwd_fd);
+    ctx->cwd_fd = fd;
+    char *cwd = fd_path(fd);
+    if (!cwd) {
+        cwd = join_path(ctx->cwd, args[1]);
+    }
+    free(ctx->cwd);
+    ctx->cwd = cwd;
+    return 0;
+}
+
+// In a forked child: move the session's fds onto 0-2 (via fresh copies, so
+// that e.g. fds[1] == 0 is not clobbered first) and enter its directory
+static void child_setup(ShellContext *ctx) {
+    int moved[3];
+    for (int fd = 0; fd < 3; fd++) {
+        moved[fd] = fcntl(ctx->fds[fd], F_DUPFD_CLOEXEC, 3);
+    }
+    for (int fd = 0; fd < 3; fd++) {
+        if (moved[fd] == -1) {
+            close(fd);
+        } else {
+            dup2(moved[fd], fd);
+            close(moved[fd]);
+        }
+    }
+    if (fchdir(ctx->cwd_fd) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+    // Forked from a pipeline thread, which blocks it
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    sigprocmask(SIG_UNBLOCK, &pipe_signal, NULL);
+}
+
+// Simplified execute_external function
+int execute_external(ShellContext *ctx, char **args) {
+    return run_external(ctx, args, ctx->command_timeout_ms, KILL_AFTER_MS);
+}
+
+// The environment a command runs with: the process environment with the
+// exported variables added or overriding. Built before fork, because the
+// child of a threaded process must not call setenv().
+static char **build_envp(ShellContext *ctx) {
+    int env_count = 0;
+    while (environ[env_count]) {
+        env_count++;
+    }
+    char **envp = (char **)malloc((env_count + ctx->var_count + 1) * sizeof(char *));
+    if (!envp) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int count = 0;
+    for (int i = 0; i < ctx->var_count; i++) {
+        ShellVar *var = &ctx->variables[i];
+        if (var->exported) {
+            size_t name_len = strlen(var->name);
+            size_t value_len = strlen(var->value);
+            char *entry = (char *)malloc(name_len + value_len + 2);
+            memcpy(entry, var->name, name_len);
+            entry[name_len] = '=';
+            memcpy(entry + name_len + 1, var->value, value_len + 1);
+            envp[count++] = entry;
+        }
+    }
+    int exported = count;
+    for (int i = 0; i < env_count; i++) {
+        const char *equals = strchr(environ[i], '=');
+        size_t name_len = equals ? (size_t)(equals - environ[i]) : strlen(environ[i]);
+        int overridden = 0;
+        for (int j = 0; j < exported && !overridden; j++) {
+            overridden = strncmp(envp[j], environ[i], name_len) == 0 && envp[j][name_len] == '=';
+        }
+        if (!overridden) {
+            envp[count++] = strdup(environ[i]);
+        }
+    }
+    envp[count] = NULL;
+    return envp;
+}
+
+static void free_envp(char **envp) {
+    for (int i = 0; envp[i]; i++) {
+        free(envp[i]);
+    }
+    free(envp);
+}
+
+// execvp() with an explicit environment: PATH is taken from envp and the
+// candidates are built on the stack, so nothing is allocated after fork.
+// Returns only on failure.
+static void exec_search(char **args, char **envp) {
+    if (strchr(args[0], '/')) {
+        execve(args[0], args, envp);
+        return;
+    }
+    const char *path = "/bin:/usr/bin";
+    for (int i = 0; envp[i]; i++) {
+        if (strncmp(envp[i], "PATH=", 5) == 0) {
+            path = envp[i] + 5;
+        }
+    }
+    size_t name_len = strlen(args[0]);
+    while (1) {
+        const char *colon = strchr(path, ':');
+        size_t dir_len = colon ? (size_t)(colon - path) : strlen(path);
+        char candidate[PATH_MAX];
+        if (dir_len + name_len + 2 <= sizeof(candidate)) {
+            // An empty entry is the current directory
+            size_t len = 0;
+            if (dir_len > 0) {
+                memcpy(candidate, path, dir_len);
+                len = dir_len;
+                candidate[len++] = '/';
+            }
+            memcpy(candidate + len, args[0], name_len + 1);
+            execve(candidate, args, envp);
+            if (errno == ENOEXEC) {
+                // No #! line: run it as a shell script, as execvp() does
+                int argc = 0;
+                while (args[argc]) {
+                    argc++;
+                }
+                char *script_args[argc + 2];
+                script_args[0] = (char *)"sh";
+                script_args[1] = candidate;
+                memcpy(script_args + 2, args + 1, argc * sizeof(char *));
+                execve("/bin/sh", script_args, envp);
+                return;
+            }
+        }
+        if (!colon) {
+            break;
+        }
+        path = colon + 1;
+    }
+}
+
+// In a forked child: become the command, with envp from build_envp()
+static void exec_command(ShellContext *ctx, char **args, char **envp) {
+    // Only the child takes on the session's fds and directory
+    child_setup(ctx);
+
+    if (ctx->current_trace) {
+        *ctx->trace_exec_stamp = monotonic_ns();
+    }
+    exec_search(args, envp);
+    dprintf(STDOUT_FILENO, "%s: command not found\n", args[0]);
+    _exit(EXIT_FAILURE);
+}
+
+int run_external(ShellContext *ctx, char **args, long timeout_ms, long kill_after_ms) {
+    // Pending output goes first, and any stdin the read builtin has read
+    // ahead is handed back
+    shell_flush(ctx);
+    read_buffer_sync(ctx);
+    char **envp = build_envp(ctx);
+    if (ctx->exec_in_place && timeout_ms == 0) {
+        exec_command(ctx, args, envp);
+    }
+    TraceTimes *times = ctx->current_trace;
+    if (times) {
+        *ctx->trace_exec_stamp = 0;
+        times->fork = monotonic_ns();
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        shell_perror(ctx, "fork");
+        free_envp(envp);
+        return -1;
+    }
+
+    // A command with a deadline gets a process group of its own, so that
+    // its children are killed along with it. Both sides set it to avoid
+    // racing the kill. Not when it talks to a terminal: a background group
+    // would be stopped on its first read (or tcsetattr), so like "timeout
+    // --foreground" it stays in the shell's group and only it is killed.
+    int own_group = timeout_ms > 0;
+    for (int fd = 0; fd < 3 && own_group; fd++) {
+        own_group = !isatty(ctx->fds[fd]);
+    }
+    if (pid == 0) {
+        if (own_group) {
+            setpgid(0, 0);
+        }
+        exec_command(ctx, args, envp);
+    }
+    free_envp(envp);
+    if (own_group) {
+        setpgid(pid, pid);
+    }
+    if (times) {
+        times->wait = monotonic_ns();
+        times->pid = pid;
+    }
+    int status = wait_for_child(ctx, pid, timeout_ms, kill_after_ms);
+    if (times) {
+        times->exec = *ctx->trace_exec_stamp;
+    }
+    return status;
+}
+
+static long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Wait until the child exits or deadline_ms (monotonic) passes.
+// Returns 1 once the child has exited (not yet reaped), 0 on timeout.
+static int wait_until(pid_t pid, int pidfd, long deadline_ms) {
+    while (1) {
+        long remaining = deadline_ms < 0 ? -1 : deadline_ms - monotonic_ms();
+        if (deadline_ms >= 0 && remaining <= 0) {
+            return 0;
+        }
+        if (pidfd != -1) {
+            struct pollfd pfd;
+            pfd.fd = pidfd;
+            pfd.events = POLLIN;
+            int ready = poll(&pfd, 1, remaining > INT_MAX ? INT_MAX : (int)remaining);
+            if (ready > 0) {
+                return 1;
+            }
+            if (ready == -1 && errno != EINTR) {
+                return 1;
+            }
+        } else {
+            // No pidfd support: peek at the child without reaping it
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || info.si_pid == pid) {
+                return 1;
+            }
+            struct timespec nap = {0, 5 * 1000000L};
+            nanosleep(&nap, NULL);
+        }
+    }
+}
+
+// Reap the child, enforcing an optional deadline. On expiry the child
+// gets SIGTERM, then SIGKILL after kill_after_ms, and TIMEOUT_STATUS is
+// returned. A child leading a process group of its own (see
+// run_external()) is signalled along with the whole group.
+int wait_for_child(ShellContext *ctx, pid_t pid, long timeout_ms, long kill_after_ms) {
+    int status = 0;
+    int timed_out = 0;
+
+    if (timeout_ms > 0) {
+        int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        if (!wait_until(pid, pidfd, monotonic_ms() + timeout_ms)) {
+            timed_out = 1;
+            pid_t target = getpgid(pid) == pid ? -pid : pid;
+            kill(target, SIGTERM);
+            if (!wait_until(pid, pidfd, monotonic_ms() + kill_after_ms)) {
+                kill(target, SIGKILL);
+            }
+        }
+        if (pidfd != -1) {
+            close(pidfd);
+        }
+    }
+
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            shell_perror(ctx, "waitpid");
+            return -1;
+        }
+    }
+    if (timed_out) {
+        return TIMEOUT_STATUS;
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+// Parse "1.5", "10s", "250ms", "2m", "1h" or "1d" into milliseconds.
+// Returns -1 for malformed input, including nan, inf and absurdly long
+// durations.
+long parse_duration(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    double scale;
+    if (*end == '\0' || strcmp(end, "s") == 0) {
+        scale = 1000;
+    } else if (strcmp(end, "ms") == 0) {
+        scale = 1;
+    } else if (strcmp(end, "m") == 0) {
+        scale = 60 * 1000;
+    } else if (strcmp(end, "h") == 0) {
+        scale = 60 * 60 * 1000;
+    } else if (strcmp(end, "d") == 0) {
+        scale = 24 * 60 * 60 * 1000;
+    } else {
+        return -1;
+    }
+    double ms = value * scale + 0.5;
+    // Also false for nan
+    if (!(ms <= MAX_DURATION_MS)) {
+        return -1;
+    }
+    return (long)ms;
+}
+
+// timeout [-k DURATION] DURATION command [args...]
+int timeout_builtin(ShellContext *ctx, char **args, int arg_count) {
+    long kill_after_ms = KILL_AFTER_MS;
+    int i = 1;
+    if (i < arg_count && strcmp(args[i], "-k") == 0) {
+        if (i + 1 >= arg_count || (kill_after_ms = parse_duration(args[i + 1])) < 0) {
+            shell_printf(ctx, STDERR_FILENO, "timeout: invalid kill duration\n");
+            return 125;
+        }
+        i += 2;
+    }
+    if (i + 1 >= arg_count) {
+        shell_printf(ctx, STDERR_FILENO, "timeout: usage: timeout [-k DURATION] DURATION command [args...]\n");
+        return 125;
+    }
+    long timeout_ms = parse_duration(args[i]);
+    if (timeout_ms < 0) {
+        shell_printf(ctx, STDERR_FILENO, "timeout: invalid time interval '%s'\n", args[i]);
+        return 125;
+    }
+    i++;
+    return run_external(ctx, args + i, timeout_ms, kill_after_ms);
+}
+
+// set -o timeout=DURATION / set +o timeout
+// set -x / set +x (also -o xtrace)
+// set -o trace=FILE / set +o trace
+int set_builtin(ShellContext *ctx, char **args, int arg_count) {
+    for (int i = 1; i < arg_count; i++) {
+        if (strcmp(args[i], "-x") == 0 || strcmp(args[i], "+x") == 0) {
+            ctx->xtrace = args[i][0] == '-';
+        } else if ((strcmp(args[i], "-o") == 0 || strcmp(args[i], "+o") == 0) && i + 1 < arg_count) {
+            int enable = args[i][0] == '-';
+            const char *option = args[++i];
+            if (strcmp(option, "xtrace") == 0) {
+                ctx->xtrace = enable;
+            } else if (enable && strncmp(option, "trace=", 6) == 0) {
+                if (trace_open(ctx, option + 6) != 0) {
+                    return 1;
+                }
+            } else if (!enable && strcmp(option, "trace") == 0) {
+                trace_close(ctx);
+            } else if (enable && strncmp(option, "timeout=", 8) == 0) {
+                long timeout_ms = parse_duration(option + 8);
+                if (timeout_ms < 0) {
+                    shell_printf(ctx, STDERR_FILENO, "set: invalid time interval '%s'\n", option + 8);
+                    return 1;
+                }
+                ctx->command_timeout_ms = timeout_ms;
+            } else if (!enable && strcmp(option, "timeout") == 0) {
+                ctx->command_timeout_ms = 0;
+            } else {
+                shell_printf(ctx, STDERR_FILENO, "set: %s: invalid option name\n", option);
+                return 1;
+            }
+        } else {
+            shell_printf(ctx, STDERR_FILENO, "set: %s: invalid option\n", args[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Execution tracing
+long long monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// set -x: echo each expanded command to stderr before running it
+void xtrace_print(ShellContext *ctx, char **args, int arg_count) {
+    StrBuf line = {NULL, 0, 0};
+    sb_append(&line, "+", 1);
+    for (int i = 0; i < arg_count; i++) {
+        sb_append(&line, " ", 1);
+        sb_append(&line, args[i], strlen(args[i]));
+    }
+    sb_append(&line, "\n", 1);
+    shell_write(ctx, STDERR_FILENO, line.data, line.len);
+    free(line.data);
+}
+
+// Start writing JSON trace events to path (appending)
+int trace_open(ShellContext *ctx, const char *path) {
+    int fd = openat(ctx->cwd_fd, path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        shell_perror(ctx, path);
+        return -1;
+    }
+    if (!ctx->trace_shared) {
+        void *page = mmap(NULL, sizeof(TraceShared), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
+            shell_perror(ctx, "mmap");
+            close(fd);
+            return -1;
+        }
+        ctx->trace_shared = (TraceShared *)page;
+        ctx->trace_exec_stamp = &ctx->trace_shared->exec_stamp;
+    }
+    trace_close(ctx);
+    ctx->trace_ring.fd = fd;
+    return 0;
+}
+
+// In a forked shell (pipeline stage, "$(...)", server batch): keep tracing
+// into the inherited fd, which the parent flushed its ring to just before
+// the fork. The exec stamp moves to a page of this process's own, since
+// its siblings may be forking commands at the same time.
+static void trace_forked(ShellContext *ctx) {
+    ctx->current_trace = NULL;
+    if (ctx->trace_ring.fd == -1) {
+        return;
+    }
+    void *page = mmap(NULL, sizeof(long long), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+        close(ctx->trace_ring.fd);
+        ctx->trace_ring.fd = -1;
+        return;
+    }
+    ctx->trace_exec_stamp = (long long *)page;
+}
+
+void trace_close(ShellContext *ctx) {
+    if (ctx->trace_ring.fd == -1) {
+        return;
+    }
+    trace_flush(ctx);
+    close(ctx->trace_ring.fd);
+    ctx->trace_ring.fd = -1;
+}
+
+// Write out every published event in order, batched into one write()
+void trace_flush(ShellContext *ctx) {
+    if (__atomic_exchange_n(&ctx->trace_ring.flushing, 1, __ATOMIC_ACQUIRE)) {
+        return;   // someone else is draining the ring
+    }
+    StrBuf batch = {NULL, 0, 0};
+    unsigned long tail = ctx->trace_ring.tail;
+    while (1) {
+        TraceSlot *slot = &ctx->trace_ring.slots[tail % TRACE_RING_SIZE];
+        if (!__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        sb_append(&batch, slot->line, strlen(slot->line));
+        free(slot->line);
+        slot->line = NULL;
+        __atomic_store_n(&slot->ready, 0, __ATOMIC_RELEASE);
+        tail++;
+    }
+    __atomic_store_n(&ctx->trace_ring.tail, tail, __ATOMIC_RELEASE);
+    if (batch.len > 0 && ctx->trace_ring.fd != -1) {
+        write_all(ctx->trace_ring.fd, batch.data, batch.len);
+    }
+    free(batch.data);
+    __atomic_store_n(&ctx->trace_ring.flushing, 0, __ATOMIC_RELEASE);
+}
+
+// Publish one formatted line, flushing once a batch has accumulated
+static void trace_push(ShellContext *ctx, char *line) {
+    unsigned long head = __atomic_fetch_add(&ctx->trace_ring.head, 1, __ATOMIC_ACQ_REL);
+    // The ring is full until the flusher has moved past this slot
+    while (head - __atomic_load_n(&ctx->trace_ring.tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE) {
+        trace_flush(ctx);
+    }
+    TraceSlot *slot = &ctx->trace_ring.slots[head % TRACE_RING_SIZE];
+    slot->line = line;
+    __atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+    if (head + 1 - __atomic_load_n(&ctx->trace_ring.tail, __ATOMIC_ACQUIRE) >= TRACE_BATCH) {
+        trace_flush(ctx);
+    }
+}
+
+static void json_string(StrBuf *sb, const char *text) {
+    sb_append(sb, "\"", 1);
+    for (const char *p = text; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\') {
+            char escaped[2] = {'\\', (char)c};
+            sb_append(sb, escaped, 2);
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            sb_append(sb, escaped, 6);
+        } else {
+            sb_append(sb, p, 1);
+        }
+    }
+    sb_append(sb, "\"", 1);
+}
+
+static void json_time(StrBuf *sb, const char *key, long long ns) {
+    char field[64];
+    if (ns) {
+        snprintf(field, sizeof(field), ",\"%s\":%lld", key, ns);
+    } else {
+        snprintf(field, sizeof(field), ",\"%s\":null", key);
+    }
+    sb_append(sb, field, strlen(field));
+}
+
+// Format one command as a JSON line. This happens after the command has
+// finished, so it never falls inside the timed intervals.
+// Note one redirection of the traced command, with the target exactly as
+// it was opened
+static void trace_redirection(TraceTimes *times, int fd, int flags, const char *target) {
+    StrBuf *sb = &times->redirections;
+    const char *op = fd == STDIN_FILENO ? "<" : (flags & O_APPEND ? ">>" : ">");
+    char field[64];
+    snprintf(field, sizeof(field), "%s{\"fd\":%d,\"op\":\"%s\",\"target\":",
+             sb->len > 0 ? "," : "", fd, op);
+    sb_append(sb, field, strlen(field));
+    json_string(sb, target);
+    sb_append(sb, "}", 1);
+}
+
+void trace_record(ShellContext *ctx, char **args, int arg_count, int status, TraceTimes *times) {
+    if (ctx->trace_ring.fd == -1) {
+        return;   // the command itself turned tracing off
+    }
+    StrBuf sb = {NULL, 0, 0};
+    char field[64];
+
+    snprintf(field, sizeof(field), "{\"seq\":%lu",
+             __atomic_fetch_add(&ctx->trace_shared->seq, 1, __ATOMIC_RELAXED));
+    sb_append(&sb, field, strlen(field));
+    sb_append(&sb, ",\"argv\":[", 9);
+    for (int i = 0; i < arg_count; i++) {
+        if (i > 0) {
+            sb_append(&sb, ",", 1);
+        }
+        json_string(&sb, args[i]);
+    }
+    sb_append(&sb, "],\"redirections\":[", 18);
+    if (times->redirections.len > 0) {
+        sb_append(&sb, times->redirections.data, times->redirections.len);
+    }
+    snprintf(field, sizeof(field), "],\"pid\":%d,\"status\":%d", (int)times->pid, status);
+    sb_append(&sb, field, strlen(field));
+    json_time(&sb, "parse_start", times->parse_start);
+    json_time(&sb, "parse_end", times->parse_end);
+    json_time(&sb, "expand", times->expand);
+    json_time(&sb, "fork", times->fork);
+    json_time(&sb, "exec", times->exec);
+    json_time(&sb, "wait", times->wait);
+    json_time(&sb, "end", times->end);
+    sb_append(&sb, "}\n", 2);
+    trace_push(ctx, sb.data);
+}
+
+// read builtin
+// Give read-ahead data back to a regular file so its offset is exactly
+// past the lines consumed so far. Read-ahead from a pipe cannot be given
+// back; it stays buffered for later reads of the same pipe.
+void read_buffer_sync(ShellContext *ctx) {
+    if (ctx->read_buffer.start == ctx->read_buffer.end) {
+        return;
+    }
+    if (ctx->read_buffer.seekable && ctx->read_buffer.generation == ctx->stdin_generation) {
+        lseek(ctx->fds[STDIN_FILENO], -(off_t)(ctx->read_buffer.end - ctx->read_buffer.start), SEEK_CUR);
+        ctx->read_buffer.start = ctx->read_buffer.end = 0;
+    }
+}
+
+// Make sure the buffer belongs to the current fd 0
+static void read_buffer_attach(ShellContext *ctx) {
+    if (ctx->read_buffer.generation == ctx->stdin_generation) {
+        return;
+    }
+    struct stat st;
+    if (fstat(ctx->fds[STDIN_FILENO], &st) == -1) {
+        st.st_dev = 0;
+        st.st_ino = 0;
+        st.st_mode = 0;
+    }
+    if (st.st_dev != ctx->read_buffer.dev || st.st_ino != ctx->read_buffer.ino || ctx->read_buffer.seekable) {
+        ctx->read_buffer.start = ctx->read_buffer.end = 0;
+    }
+    ctx->read_buffer.dev = st.st_dev;
+    ctx->read_buffer.ino = st.st_ino;
+    ctx->read_buffer.seekable = S_ISREG(st.st_mode);
+    ctx->read_buffer.generation = ctx->stdin_generation;
+}
+
+// Read one line (without its newline) into line. Returns 0 when a
+// newline-terminated line was read, 1 at end of input (line may still
+// hold a final unterminated line), -1 on error.
+static int read_buffered_line(ShellContext *ctx, StrBuf *line) {
+    read_buffer_attach(ctx);
+    if (!ctx->read_buffer.data) {
+        ctx->read_buffer.cap = READ_BUFFER_SIZE;
+        ctx->read_buffer.data = (char *)malloc(ctx->read_buffer.cap);
+        if (!ctx->read_buffer.data) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while (1) {
+        char *start = ctx->read_buffer.data + ctx->read_buffer.start;
+        size_t avail = ctx->read_buffer.end - ctx->read_buffer.start;
+        char *newline = (char *)memchr(start, '\n', avail);
+        if (newline) {
+            sb_append(line, start, newline - start);
+            ctx->read_buffer.start += newline - start + 1;
+            return 0;
+        }
+
+        // Keep the partial line and refill behind it
+        sb_append(line, start, avail);
+        ctx->read_buffer.start = ctx->read_buffer.end = 0;
+        ssize_t n = read(ctx->fds[STDIN_FILENO], ctx->read_buffer.data, ctx->read_buffer.cap);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            shell_perror(ctx, "read");
+            return -1;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        ctx->read_buffer.end = n;
+    }
+}
+
+// read [-r] [NAME...]
+// Reads a line from stdin and splits it on blanks; the last NAME gets the
+// rest of the line. Without -r, backslash escapes the next character and a
+// trailing backslash joins the next line.
+int read_builtin(ShellContext *ctx, char **args, int arg_count) {
+    int raw = 0;
+    int first = 1;
+    if (first < arg_count && strcmp(args[first], "-r") == 0) {
+        raw = 1;
+        first++;
+    }
+
+    StrBuf line = {NULL, 0, 0};
+    sb_append(&line, "", 0);
+    int result;
+    while (1) {
+        if (ctx->stdin_redirect_depth == 0 && ctx->script_input) {
+            // stdin is also where the script comes from: share stdio's buffer
+            char *text = NULL;
+            size_t text_size = 0;
+            ssize_t len = getline(&text, &text_size, ctx->script_input);
+            result = 1;
+            if (len > 0) {
+                if (text[len - 1] == '\n') {
+                    len--;
+                    result = 0;
+                }
+                sb_append(&line, text, len);
+            }
+            free(text);
+        } else {
+            result = read_buffered_line(ctx, &line);
+        }
+        if (result != 0 || raw || line.len == 0 || line.data[line.len - 1] != '\\') {
+            break;
+        }
+        // Line continuation
+        line.data[--line.len] = '\0';
+    }
+    if (result == -1) {
+        free(line.data);
+        return 1;
+    }
+
+    // Split into fields, honouring backslash escapes unless -r. Without
+    // names the whole line goes to REPLY, blanks included.
+    int names = arg_count - first;
+    int split = names > 0;
+    int field = 0;
+    StrBuf value = {NULL, 0, 0};
+    sb_append(&value, "", 0);
+    // Trailing blanks up to here were escaped and are kept
+    size_t escaped_len = 0;
+    const char *p = line.data;
+    while (split && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    while (1) {
+        int last = !split || field == names - 1;
+        if (*p == '\0' || (!last && (*p == ' ' || *p == '\t'))) {
+            if (last && split) {
+                // The last name keeps inner blanks but not trailing ones
+                while (value.len > escaped_len && (value.data[value.len - 1] == ' ' ||
+                                                   value.data[value.len - 1] == '\t')) {
+                    value.data[--value.len] = '\0';
+                }
+            }
+            add_or_update_var(ctx, split ? args[first + field] : "REPLY", value.data, 0);
+            value.len = 0;
+            value.data[0] = '\0';
+            escaped_len = 0;
+            field++;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            continue;
+        }
+        if (*p == '\\' && !raw && p[1] != '\0') {
+            sb_append(&value, p + 1, 1);
+            escaped_len = value.len;
+            p += 2;
+            continue;
+        }
+        sb_append(&value, p, 1);
+        p++;
+    }
+    // Names without a field of their own are set empty
+    for (; field < names; field++) {
+        add_or_update_var(ctx, args[first + field], "", 0);
+    }
+
+    free(value.data);
+    free(line.data);
+    return result == 0 ? 0 : 1;
+}
+
+// cat builtin (the copying itself is in copy_fd.h)
+// Copy stdin to stdout, starting with whatever the shell already buffered
+static int copy_stdin(ShellContext *ctx, const struct stat *out_st) {
+    // stdin is also the script: go through stdio like read does. Not on a
+    // terminal: there stdio holds nothing between commands (a line at a
+    // time), and fread() would wait for a full block or a second Ctrl-D.
+    if (ctx->stdin_redirect_depth == 0 && ctx->script_input && !isatty(ctx->fds[STDIN_FILENO])) {
+        char buffer[8192];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), ctx->script_input)) > 0) {
+            if (write_all(ctx->fds[STDOUT_FILENO], buffer, n) == -1) {
+                return COPY_FAILED;
+            }
+        }
+        clearerr(ctx->script_input);
+        return COPY_DONE;
+    }
+    read_buffer_sync(ctx);
+    if (ctx->read_buffer.generation == ctx->stdin_generation && ctx->read_buffer.start < ctx->read_buffer.end) {
+        if (write_all(ctx->fds[STDOUT_FILENO], ctx->read_buffer.data + ctx->read_buffer.start,
+                      ctx->read_buffer.end - ctx->read_buffer.start) == -1) {
+            return COPY_FAILED;
+        }
+        ctx->read_buffer.start = ctx->read_buffer.end = 0;
+    }
+    return copy_fd(ctx->fds[STDIN_FILENO], ctx->fds[STDOUT_FILENO], out_st);
+}
+
+// cat [FILE...] without forking. Options are left to the real cat.
+int cat_builtin(ShellContext *ctx, char **args, int arg_count) {
+    for (int i = 1; i < arg_count; i++) {
+        if (args[i][0] == '-' && args[i][1] != '\0') {
+            return execute_external(ctx, args);
+        }
+    }
+
+    shell_flush(ctx);
+    struct stat out_st;
+    if (fstat(ctx->fds[STDOUT_FILENO], &out_st) == -1) {
+        shell_perror(ctx, "cat: stdout");
+        return 1;
+    }
+
+    int status = 0;
+    int file_count = arg_count > 1 ? arg_count - 1 : 1;
+    for (int i = 0; i < file_count; i++) {
+        const char *path = arg_count > 1 ? args[i + 1] : "-";
+        int result;
+        if (strcmp(path, "-") == 0) {
+            result = copy_stdin(ctx, &out_st);
+        } else {
+            int in_fd = openat(ctx->cwd_fd, path, O_RDONLY | O_CLOEXEC);
+            if (in_fd == -1) {
+                shell_printf(ctx, STDERR_FILENO, "cat: %s: %s\n", path, strerror(errno));
+                status = 1;
+                continue;
+            }
+            result = copy_fd(in_fd, ctx->fds[STDOUT_FILENO], &out_st);
+            close(in_fd);
+        }
+        if (result == COPY_FAILED && errno == EPIPE) {
+            // Reader gone, see shell_flush()
+            ctx->broken_pipe = 1;
+            ctx->exit_requested = 1;
+            return 1;
+        }
+        if (result == COPY_SAME_FILE) {
+            shell_printf(ctx, STDERR_FILENO, "cat: %s: input file is output file\n", path);
+            status = 1;
+        } else if (result == COPY_FAILED) {
+            shell_printf(ctx, STDERR_FILENO, "cat: %s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Variable system
+void add_or_update_var(ShellContext *ctx, const char *name, const char *value, int exported) {
+    for (int i = 0; i < ctx->var_count; i++) {
+        if (strcmp(ctx->variables[i].name, name) == 0) {
+            free(ctx->variables[i].value);
+            ctx->variables[i].value = strdup(value);
+            if (exported) ctx->variables[i].exported = 1;
+            return;
+        }
+    }
+
+    ctx->variables = (ShellVar *)realloc(ctx->variables, sizeof(ShellVar) * (ctx->var_count + 1));
+    ctx->variables[ctx->var_count].name = strdup(name);
+    ctx->variables[ctx->var_count].value = strdup(value);
+    ctx->variables[ctx->var_count].exported = exported;
+    ctx->var_count++;
+}
+
+const char *get_var_value(ShellContext *ctx, const char *name) {
+    for (int i = 0; i < ctx->var_count; i++) {
+        if (strcmp(ctx->variables[i].name, name) == 0) {
+            return ctx->variables[i].value;
+        }
+    }
+    return NULL;
+}
+
+void export_var(ShellContext *ctx, const char *name) {
+    for (int i = 0; i < ctx->var_count; i++) {
+        if (strcmp(ctx->variables[i].name, name) == 0) {
+            ctx->variables[i].exported = 1;
+            return;
+        }
+    }
+    shell_printf(ctx, STDOUT_FILENO, "export: %s: not found\n", name);
+}
+
+static void sb_append(StrBuf *sb, const char *text, size_t len) {
+    if (sb->len + len + 1 > sb->cap) {
+        sb->cap = (sb->len + len + 1) * 2;
+        sb->data = (char *)realloc(sb->data, sb->cap);
+        if (!sb->data) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(sb->data + sb->len, text, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+}
+
+// Reads a pipe to EOF into data, on a helper thread of its own when the
+// writer is the shell itself
+typedef struct {
+    int fd;
+    StrBuf data;
+    pthread_t thread;
+} PipeDrain;
+
+static void *drain_pipe(void *arg) {
+    PipeDrain *drain = (PipeDrain *)arg;
+    char buffer[8192];
+    while (1) {
+        ssize_t n = read(drain->fd, buffer, sizeof(buffer));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        sb_append(&drain->data, buffer, n);
+    }
+    return NULL;
+}
+
+// Append the output of "$(script)", less its trailing newlines, to sb.
+// The script runs in a subshell: a builtin-only one in a subshell context
+// right here, its stdout drained by a helper thread, anything else in a
+// forked child. Its status goes to ctx->last_status.
+static void command_substitution(ShellContext *ctx, StrBuf *sb, const char *script) {
+    ctx->substitutions++;
+    // The command being expanded keeps its own parse times
+    long long parse_start = ctx->script_parse_start;
+    long long parse_end = ctx->script_parse_end;
+    Node *tree = NULL;
+    int result = parse_script(ctx, script, &tree);
+    ctx->script_parse_start = parse_start;
+    ctx->script_parse_end = parse_end;
+    if (result != PARSE_OK) {
+        if (result == PARSE_INCOMPLETE) {
+            shell_printf(ctx, STDOUT_FILENO, "syntax error: unexpected end of file\n");
+        }
+        ctx->last_status = 2;
+        return;
+    }
+    if (!tree) {
+        ctx->last_status = 0;
+        return;
+    }
+    int out[2];
+    if (syscall(SYS_pipe2, out, O_CLOEXEC) == -1) {
+        shell_perror(ctx, "pipe");
+        ctx->last_status = 1;
+        free_node(tree);
+        return;
+    }
+
+    PipeDrain drain = {out[0], {NULL, 0, 0}, 0};
+    shell_flush(ctx);
+    read_buffer_sync(ctx);
+    // Events of the enclosing script are written before any the child adds
+    trace_flush(ctx);
+    ShellContext *sub = builtin_only(tree) ? shell_subshell(ctx, ctx->fds[STDIN_FILENO], out[1]) : NULL;
+    if (sub && pthread_create(&drain.thread, NULL, drain_pipe, &drain) == 0) {
+        ctx->last_status = execute_node(sub, tree);
+        shell_destroy(sub);
+        close(out[1]);
+        pthread_join(drain.thread, NULL);
+    } else {
+        if (sub) {
+            shell_destroy(sub);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(out[0]);
+            ctx->fds[STDOUT_FILENO] = out[1];
+            ctx->out_is_tty = 0;
+            trace_forked(ctx);
+            ctx->subshell = 1;
+            int status = execute_node(ctx, tree);
+            shell_flush(ctx);
+            trace_flush(ctx);
+            _exit(status & 0xff);
+        }
+        close(out[1]);
+        if (pid == -1) {
+            shell_perror(ctx, "fork");
+            ctx->last_status = 1;
+        } else {
+            drain_pipe(&drain);
+            ctx->last_status = wait_for_child(ctx, pid, 0, 0);
+        }
+    }
+    close(out[0]);
+    free_node(tree);
+
+    size_t len = drain.data.len;
+    while (len > 0 && drain.data.data[len - 1] == '\n') {
+        len--;
+    }
+    if (len > 0) {
+        sb_append(sb, drain.data.data, len);
+    }
+    free(drain.data.data);
+}
+
+// Expand "$?", "${NAME}", "$NAME" or "$(script)" at p (which points at
+// the '$'). Returns the first character after the reference.
+static const char *expand_variable(ShellContext *ctx, StrBuf *sb, const char *p, const char *end) {
+    char var_name[256];
+    int vi = 0;
+    const char *q = p + 1;
+
+    if (q < end && *q == '(') {
+        int incomplete = 0;
+        const char *close = scan_substitution(p, end, &incomplete);
+        if (incomplete) {
+            sb_append(sb, p, end - p);
+            return end;
+        }
+        char *script = strndup(q + 1, close - q - 2);
+        command_substitution(ctx, sb, script);
+        free(script);
+        return close;
+    }
+    if (q < end && *q == '?') {
+        char status_buf[16];
+        snprintf(status_buf, sizeof(status_buf), "%d", ctx->last_status);
+        sb_append(sb, status_buf, strlen(status_buf));
+        return q + 1;
+    }
+    int braced = q < end && *q == '{';
+    if (braced) {
+        q++;
+    }
+    // Read variable name (letters, digits, underscores)
+    while (q < end && (isalnum((unsigned char)*q) || *q == '_')) {
+        if (vi < 255) {
+            var_name[vi++] = *q;
+        }
+        q++;
+    }
+    var_name[vi] = '\0';
+    if (braced) {
+        if (q >= end || *q != '}') {
+            // Not a well-formed ${NAME}: keep it literally
+            sb_append(sb, p, q - p);
+            return q;
+        }
+        q++;
+    }
+    if (vi == 0 && !braced) {
+        sb_append(sb, "$", 1);
+        return q;
+    }
+
+    // If variable doesn't exist, skip (leave blank)
+    const char *val = get_var_value(ctx, var_name);
+    if (val) {
+        sb_append(sb, val, strlen(val));
+    }
+    return q;
+}
+
+// Expand one raw word from the tree: variables are substituted and quotes
+// and backslashes removed. Nothing is expanded inside single quotes.
+char *expand_word(ShellContext *ctx, const char *word) {
+    const char *end = word + strlen(word);
+    if (word[strcspn(word, "'\"\\$")] == '\0') {
+        return strdup(word);
+    }
+
+    StrBuf sb = {NULL, 0, 0};
+    sb_append(&sb, "", 0);
+    int in_double = 0;
+    const char *p = word;
+    while (p < end) {
+        const char *special = scan_special(p, end);
+        sb_append(&sb, p, special - p);
+        p = special;
+        if (p >= end) {
+            break;
+        }
+        char c = *p;
+        if (c == '\'' && !in_double) {
+            const char *close = (const char *)memchr(p + 1, '\'', end - p - 1);
+            if (!close) {
+                close = end;
+            }
+            sb_append(&sb, p + 1, close - p - 1);
+            p = close < end ? close + 1 : end;
+        } else if (c == '"') {
+            in_double = !in_double;
+            p++;
+        } else if (c == '\\' && p + 1 < end) {
+            char next = p[1];
+            if (next == '\n') {
+                // Line continuation
+            } else if (!in_double || strchr("$\"\\`", next)) {
+                sb_append(&sb, p + 1, 1);
+            } else {
+                sb_append(&sb, p, 2);
+            }
+            p += 2;
+        } else if (c == '$') {
+            p = expand_variable(ctx, &sb, p, end);
+        } else {
+            sb_append(&sb, p, 1);
+            p++;
+        }
+    }
+    return sb.data;
+}
+
+void substitute_variables(ShellContext *ctx, char **args, int arg_count) {
+    for (int i = 0; i < arg_count; i++) {
+        char *result = expand_word(ctx, args[i]);
+        free(args[i]);
+        args[i] = result;
+    }
+}
+
+// Command parsing and execution
+static void push_token(Token **tokens, int *count, int *cap, TokenType type, char *text) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 32;
+        *tokens = (Token *)realloc(*tokens, *cap * sizeof(Token));
+        if (!*tokens) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*tokens)[*count].type = type;
+    (*tokens)[*count].text = text;
+    (*count)++;
+}
+
+// Characters the lexer and expander have to stop at: blanks and control
+// characters, operators, quotes, backslash and '$'
+static int is_special_char(unsigned char c) {
+    switch (c) {
+    case ';': case '&': case '|': case '<': case '>':
+    case '\'': case '"': case '\\': case '$':
+        return 1;
+    default:
+        return c <= ' ';
+    }
+}
+
+static const char *scan_special_scalar(const char *p, const char *end) {
+    while (p < end && !is_special_char((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef LEXER_SIMD
+// Special characters other than blanks, which are matched as bytes <= ' '
+static const char SPECIAL_SET[] = ";&|<>'\"\\$";
+#define SPECIAL_SET_SIZE (sizeof(SPECIAL_SET) - 1)
+
+// Compare a whole block against every special character at once; movemask
+// gives one bit per byte, so the first special is the lowest set bit.
+static const char *scan_special_sse2(const char *p, const char *end) {
+    const __m128i blank = _mm_set1_epi8(' ');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_cmpeq_epi8(_mm_min_epu8(v, blank), v);
+        for (size_t i = 0; i < SPECIAL_SET_SIZE; i++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(v, _mm_set1_epi8(SPECIAL_SET[i])));
+        }
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return scan_special_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_special_avx2(const char *p, const char *end) {
+    const __m256i blank = _mm256_set1_epi8(' ');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hits = _mm256_cmpeq_epi8(_mm256_min_epu8(v, blank), v);
+        for (size_t i = 0; i < SPECIAL_SET_SIZE; i++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(SPECIAL_SET[i])));
+        }
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return scan_special_sse2(p, end);
+}
+
+// Picked once per process; sessions may lex on several threads at once
+static const char *(*scan_special_impl)(const char *, const char *) = scan_special_sse2;
+static pthread_once_t scan_special_once = PTHREAD_ONCE_INIT;
+
+static void scan_special_select() {
+    if (__builtin_cpu_supports("avx2")) {
+        scan_special_impl = scan_special_avx2;
+    }
+}
+#endif
+
+// Return the first special character in [p, end), or end
+const char *scan_special(const char *p, const char *end) {
+#ifdef LEXER_SIMD
+    pthread_once(&scan_special_once, scan_special_select);
+    return scan_special_impl(p, end);
+#else
+    return scan_special_scalar(p, end);
+#endif
+}
+
+// Find the end of the "$(...)" at p, skipping quoted parentheses. Sets
+// *incomplete (and returns end) when it is not closed.
+static const char *scan_substitution(const char *p, const char *end, int *incomplete) {
+    int depth = 0;
+    p += 1;
+    while (p < end) {
+        char c = *p;
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth == 0) {
+                return p + 1;
+            }
+        } else if (c == '\'') {
+            p = (const char *)memchr(p + 1, '\'', end - p - 1);
+            if (!p) {
+                break;
+            }
+        } else if (c == '"') {
+            for (p++; p < end && *p != '"'; p++) {
+                if (*p == '\\') {
+                    p++;
+                } else if (*p == '$' && p + 1 < end && p[1] == '(') {
+                    p = scan_substitution(p, end, incomplete) - 1;
+                }
+            }
+            if (p >= end) {
+                break;
+            }
+        } else if (c == '\\') {
+            p++;
+        }
+        p++;
+    }
+    *incomplete = 1;
+    return end;
+}
+
+// Find the end of the word starting at p. Quotes and backslashes are kept
+// in the word (the expander removes them later). Sets *incomplete when a
+// quote or trailing backslash runs past the end of the input.
+static const char *scan_word(const char *p, const char *end, int *incomplete) {
+    while (p < end) {
+        p = scan_special(p, end);
+        if (p >= end) {
+            break;
+        }
+        char c = *p;
+        if (c == '\'') {
+            const char *close = (const char *)memchr(p + 1, '\'', end - p - 1);
+            if (!close) {
+                *incomplete = 1;
+                return end;
+            }
+            p = close + 1;
+        } else if (c == '"') {
+            p++;
+            while (1) {
+                p = scan_special(p, end);
+                if (p >= end) {
+                    *incomplete = 1;
+                    return end;
+                }
+                if (*p == '"') {
+                    p++;
+                    break;
+                }
+                if (*p == '$' && p + 1 < end && p[1] == '(') {
+                    p = scan_substitution(p, end, incomplete);
+                    if (*incomplete) {
+                        return end;
+                    }
+                    continue;
+                }
+                p += (*p == '\\' && p + 1 < end) ? 2 : 1;
+            }
+        } else if (c == '\\') {
+            if (p + 1 >= end) {
+                *incomplete = 1;
+                return end;
+            }
+            p += 2;
+        } else if (c == '$' && p + 1 < end && p[1] == '(') {
+            p = scan_substitution(p, end, incomplete);
+        } else if (c == '$' || (c == '&' && p[1] != '&') ||
+                   (c != ' ' && c != '\t' && c != '\n' && c != '\r' && (unsigned char)c < ' ')) {
+            // Not a delimiter here
+            p++;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+// Split a script into words, redirections and control operators
+// (; && || | newline). The returned array always ends with a TOK_EOF token.
+Token *tokenize(const char *input, int *token_count, int *incomplete) {
+    Token *tokens = NULL;
+    int count = 0;
+    int cap = 0;
+    const char *p = input;
+    const char *end = input + strlen(input);
+
+    *incomplete = 0;
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        } else if (*p == '#') {
+            // Comment runs to the end of the line
+            const char *newline = (const char *)memchr(p, '\n', end - p);
+            p = newline ? newline : end;
+        } else if (*p == '\n') {
+            push_token(&tokens, &count, &cap, TOK_NEWLINE, NULL);
+            p++;
+        } else if (*p == ';') {
+            push_token(&tokens, &count, &cap, TOK_SEMI, NULL);
+            p++;
+        } else if (p[0] == '&' && p[1] == '&') {
+            push_token(&tokens, &count, &cap, TOK_AND, NULL);
+            p += 2;
+        } else if (p[0] == '|' && p[1] == '|') {
+            push_token(&tokens, &count, &cap, TOK_OR, NULL);
+            p += 2;
+        } else if (*p == '|') {
+            push_token(&tokens, &count, &cap, TOK_PIPE, NULL);
+            p++;
+        } else if (*p == '<' || *p == '>' || (p[0] == '2' && p[1] == '>')) {
+            const char *start = p;
+            if (*p == '2') {
+                p++;
+            }
+            if (p[0] == '>' && p[1] == '>') {
+                p += 2;
+            } else {
+                p++;
+            }
+            push_token(&tokens, &count, &cap, TOK_REDIRECT, strndup(start, p - start));
+        } else {
+            const char *start = p;
+            p = scan_word(p, end, incomplete);
+            char *word = strndup(start, p - start);
+            if (!word) {
+                perror("strndup");
+                exit(EXIT_FAILURE);
+            }
+            push_token(&tokens, &count, &cap, TOK_WORD, word);
+        }
+    }
+    push_token(&tokens, &count, &cap, TOK_EOF, NULL);
+    *token_count = count;
+    return tokens;
+}
+
+void free_tokens(Token *tokens, int token_count) {
+    for (int i = 0; i < token_count; i++) {
+        free(tokens[i].text);
+    }
+    free(tokens);
+}
+
+static Node *new_node(NodeType type) {
+    Node *node = (Node *)calloc(1, sizeof(Node));
+    if (!node) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    node->type = type;
+    return node;
+}
+
+void free_node(Node *node) {
+    if (!node) {
+        return;
+    }
+    free_args(node->words, node->word_count);
+    for (int i = 0; i < node->redir_count; i++) {
+        free(node->redirs[i].target);
+    }
+    free(node->redirs);
+    free(node->name);
+    for (int i = 0; i < node->child_count; i++) {
+        free_node(node->children[i]);
+    }
+    free(node->children);
+    free_node(node->cond);
+    free_node(node->body);
+    free_node(node->alt);
+    free(node);
+}
+
+static Token *peek(Parser *p) {
+    return &p->tokens[p->pos];
+}
+
+// Reserved words only count when they appear where a command would start
+static int at_word(Parser *p, const char *word) {
+    Token *tok = peek(p);
+    return tok->type == TOK_WORD && strcmp(tok->text, word) == 0;
+}
+
+static int at_terminator(Parser *p) {
+    return at_word(p, "then") || at_word(p, "elif") || at_word(p, "else") ||
+           at_word(p, "fi") || at_word(p, "do") || at_word(p, "done");
+}
+
+static void syntax_error(Parser *p) {
+    if (p->error || p->incomplete) {
+        return;
+    }
+    Token *tok = peek(p);
+    if (tok->type == TOK_EOF) {
+        p->incomplete = 1;
+        return;
+    }
+    const char *text = tok->text;
+    switch (tok->type) {
+    case TOK_SEMI: text = ";"; break;
+    case TOK_NEWLINE: text = "newline"; break;
+    case TOK_AND: text = "&&"; break;
+    case TOK_OR: text = "||"; break;
+    case TOK_PIPE: text = "|"; break;
+    default: break;
+    }
+    shell_printf(p->ctx, STDOUT_FILENO, "syntax error near unexpected token `%s'\n", text);
+    p->error = 1;
+}
+
+static int expect_word(Parser *p, const char *word) {
+    if (!at_word(p, word)) {
+        syntax_error(p);
+        return 0;
+    }
+    p->pos++;
+    return 1;
+}
+
+static void skip_separators(Parser *p) {
+    while (peek(p)->type == TOK_SEMI || peek(p)->type == TOK_NEWLINE) {
+        p->pos++;
+    }
+}
+
+static void skip_newlines(Parser *p) {
+    while (peek(p)->type == TOK_NEWLINE) {
+        p->pos++;
+    }
+}
+
+static Node *parse_list(Parser *p);
+
+static Node *parse_if(Parser *p) {
+    Node *node = new_node(NODE_IF);
+    p->pos++;   // "if" or "elif"
+    node->cond = parse_list(p);
+    if (!node->cond) {
+        syntax_error(p);
+    }
+    if (p->error || p->incomplete || !expect_word(p, "then")) {
+        return node;
+    }
+    node->body = parse_list(p);
+    if (!node->body) {
+        syntax_error(p);
+    }
+    if (p->error || p->incomplete) {
+        return node;
+    }
+    if (at_word(p, "elif")) {
+        node->alt = parse_if(p);
+        return node;
+    }
+    if (at_word(p, "else")) {
+        p->pos++;
+        node->alt = parse_list(p);
+        if (!node->alt) {
+            syntax_error(p);
+        }
+        if (p->error || p->incomplete) {
+            return node;
+        }
+    }
+    expect_word(p, "fi");
+    return node;
+}
+
+static Node *parse_loop_body(Parser *p, Node *node) {
+    if (p->error || p->incomplete || !expect_word(p, "do")) {
+        return node;
+    }
+    node->body = parse_list(p);
+    if (!node->body) {
+        syntax_error(p);
+    }
+    if (p->error || p->incomplete) {
+        return node;
+    }
+    expect_word(p, "done");
+    return node;
+}
+
+static Node *parse_for(Parser *p) {
+    Node *node = new_node(NODE_FOR);
+    p->pos++;   // "for"
+    Token *tok = peek(p);
+    if (tok->type != TOK_WORD) {
+        syntax_error(p);
+        return node;
+    }
+    node->name = strdup(tok->text);
+    p->pos++;
+    skip_newlines(p);
+    if (at_word(p, "in")) {
+        p->pos++;
+        int cap = 0;
+        while (peek(p)->type == TOK_WORD) {
+            if (node->word_count + 1 >= cap) {
+                cap = cap ? cap * 2 : 8;
+                node->words = (char **)realloc(node->words, cap * sizeof(char *));
+                if (!node->words) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            node->words[node->word_count++] = strdup(peek(p)->text);
+            p->pos++;
+        }
+        if (node->words) {
+            node->words[node->word_count] = NULL;
+        }
+    }
+    skip_separators(p);
+    return parse_loop_body(p, node);
+}
+
+static Node *parse_while(Parser *p, NodeType type) {
+    Node *node = new_node(type);
+    p->pos++;   // "while" or "until"
+    node->cond = parse_list(p);
+    if (!node->cond) {
+        syntax_error(p);
+    }
+    return parse_loop_body(p, node);
+}
+
+// Parse "OP target" and attach it to node
+static int parse_redirect(Parser *p, Node *node) {
+    const char *op = peek(p)->text;
+    p->pos++;
+    if (peek(p)->type != TOK_WORD) {
+        if (peek(p)->type == TOK_EOF || peek(p)->type == TOK_NEWLINE) {
+            shell_printf(p->ctx, STDOUT_FILENO, "syntax error near unexpected token `newline'\n");
+            p->error = 1;
+        } else {
+            syntax_error(p);
+        }
+        return 0;
+    }
+
+    Redirect redir;
+    redir.fd = op[0] == '<' ? STDIN_FILENO : (op[0] == '2' ? STDERR_FILENO : STDOUT_FILENO);
+    if (redir.fd == STDIN_FILENO) {
+        redir.flags = O_RDONLY;
+    } else if (strstr(op, ">>")) {
+        redir.flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        redir.flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    redir.target = strdup(peek(p)->text);
+    p->pos++;
+
+    node->redirs = (Redirect *)realloc(node->redirs, (node->redir_count + 1) * sizeof(Redirect));
+    if (!node->redirs) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    node->redirs[node->redir_count++] = redir;
+    return 1;
+}
+
+static Node *parse_command_node(Parser *p) {
+    Node *compound = NULL;
+    if (at_word(p, "if")) {
+        compound = parse_if(p);
+    } else if (at_word(p, "for")) {
+        compound = parse_for(p);
+    } else if (at_word(p, "while")) {
+        compound = parse_while(p, NODE_WHILE);
+    } else if (at_word(p, "until")) {
+        compound = parse_while(p, NODE_UNTIL);
+    }
+    if (compound) {
+        // e.g. "while read line; do ...; done < file"
+        while (!p->error && !p->incomplete && peek(p)->type == TOK_REDIRECT) {
+            if (!parse_redirect(p, compound)) {
+                break;
+            }
+        }
+        return compound;
+    }
+
+    if ((peek(p)->type != TOK_WORD && peek(p)->type != TOK_REDIRECT) || at_terminator(p)) {
+        syntax_error(p);
+        return NULL;
+    }
+
+    Node *node = new_node(NODE_COMMAND);
+    int cap = 0;
+    while (peek(p)->type == TOK_WORD || peek(p)->type == TOK_REDIRECT) {
+        if (peek(p)->type == TOK_REDIRECT) {
+            if (!parse_redirect(p, node)) {
+                break;
+            }
+            continue;
+        }
+        if (node->word_count + 1 >= cap) {
+            cap = cap ? cap * 2 : 8;
+            node->words = (char **)realloc(node->words, cap * sizeof(char *));
+            if (!node->words) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        node->words[node->word_count++] = strdup(peek(p)->text);
+        p->pos++;
+    }
+    if (node->words) {
+        node->words[node->word_count] = NULL;
+    }
+    return node;
+}
+
+// command [| command]...
+static Node *parse_pipeline(Parser *p) {
+    Node *first = parse_command_node(p);
+    if (!first || p->error || p->incomplete || peek(p)->type != TOK_PIPE) {
+        return first;
+    }
+    Node *node = new_node(NODE_PIPELINE);
+    int cap = 0;
+    Node *stage = first;
+    while (stage) {
+        if (node->child_count == cap) {
+            cap = cap ? cap * 2 : 4;
+            node->children = (Node **)realloc(node->children, cap * sizeof(Node *));
+            if (!node->children) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        node->children[node->child_count++] = stage;
+        if (p->error || p->incomplete || peek(p)->type != TOK_PIPE) {
+            break;
+        }
+        p->pos++;
+        skip_newlines(p);
+        stage = parse_command_node(p);
+    }
+    return node;
+}
+
+static Node *parse_and_or(Parser *p) {
+    Node *left = parse_pipeline(p);
+    while (!p->error && !p->incomplete &&
+           (peek(p)->type == TOK_AND || peek(p)->type == TOK_OR)) {
+        Node *node = new_node(peek(p)->type == TOK_AND ? NODE_AND : NODE_OR);
+        p->pos++;
+        skip_newlines(p);
+        node->cond = left;
+        node->body = parse_pipeline(p);
+        left = node;
+    }
+    return left;
+}
+
+// Parse commands up to the end of input or a reserved word that closes
+// the enclosing construct. Returns NULL for an empty list.
+static Node *parse_list(Parser *p) {
+    Node *list = new_node(NODE_LIST);
+    int cap = 0;
+
+    skip_separators(p);
+    while (!p->error && !p->incomplete && peek(p)->type != TOK_EOF && !at_terminator(p)) {
+        Node *child = parse_and_or(p);
+        if (child) {
+            if (list->child_count == cap) {
+                cap = cap ? cap * 2 : 4;
+                list->children = (Node **)realloc(list->children, cap * sizeof(Node *));
+                if (!list->children) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            list->children[list->child_count++] = child;
+        }
+        if (p->error || p->incomplete) {
+            break;
+        }
+        TokenType next = peek(p)->type;
+        if (next == TOK_SEMI || next == TOK_NEWLINE) {
+            skip_separators(p);
+        } else if (next != TOK_EOF && !at_terminator(p)) {
+            syntax_error(p);
+        }
+    }
+
+    if (list->child_count == 0) {
+        free_node(list);
+        return NULL;
+    }
+    if (list->child_count == 1) {
+        Node *only = list->children[0];
+        list->child_count = 0;
+        free_node(list);
+        return only;
+    }
+    return list;
+}
+
+// Parse a complete script into a tree. PARSE_INCOMPLETE means the input
+// stops in the middle of a construct and more lines are needed.
+int parse_script(ShellContext *ctx, const char *script, Node **out) {
+    // Every parse resets both times, so no command reports those of an
+    // earlier script
+    int timed = ctx->current_trace || ctx->trace_ring.fd != -1;
+    ctx->script_parse_start = timed ? monotonic_ns() : 0;
+    ctx->script_parse_end = 0;
+    Parser p;
+    p.tokens = tokenize(script, &p.count, &p.incomplete);
+    p.pos = 0;
+    p.error = 0;
+    p.ctx = ctx;
+    if (p.incomplete) {
+        free_tokens(p.tokens, p.count);
+        *out = NULL;
+        return PARSE_INCOMPLETE;
+    }
+
+    Node *tree = parse_list(&p);
+    if (!p.error && !p.incomplete && peek(&p)->type != TOK_EOF) {
+        syntax_error(&p);
+    }
+    free_tokens(p.tokens, p.count);
+
+    *out = NULL;
+    if (p.error || p.incomplete) {
+        free_node(tree);
+        return p.error ? PARSE_ERROR : PARSE_INCOMPLETE;
+    }
+    *out = tree;
+    if (timed) {
+        ctx->script_parse_end = monotonic_ns();
+    }
+    return PARSE_OK;
+}
+
+void free_args(char **args, int arg_count) {
+    for (int i = 0; i < arg_count; i++) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+// Run a whole script non-interactively, e.g. one batch received by the server
+int run_script(ShellContext *ctx, const char *script) {
+    Node *tree = NULL;
+    int result = parse_script(ctx, script, &tree);
+    int status = ctx->last_status;
+    if (result == PARSE_INCOMPLETE) {
+        shell_printf(ctx, STDOUT_FILENO, "syntax error: unexpected end of file\n");
+        status = 2;
+    } else if (result == PARSE_ERROR) {
+        status = 2;
+    } else if (tree) {
+        status = execute_node(ctx, tree);
+        ctx->last_status = status;
+        free_node(tree);
+    }
+    // The caller may _exit() next (a server batch): nothing may stay buffered
+    shell_flush(ctx);
+    return status;
+}
+
+// Server mode
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t len) {
+    char *p = (char *)data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, char type, const char *payload, uint32_t len) {
+    unsigned char header[5];
+    header[0] = (unsigned char)type;
+    header[1] = (unsigned char)(len >> 24);
+    header[2] = (unsigned char)(len >> 16);
+    header[3] = (unsigned char)(len >> 8);
+    header[4] = (unsigned char)len;
+    if (write_all(fd, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    return write_all(fd, payload, len);
+}
+
+// Read one frame; the payload is NUL terminated for convenience. The
+// length comes from the peer, so anything over FRAME_MAX is refused.
+static int recv_frame(int fd, char *type, char **payload, uint32_t *len) {
+    unsigned char header[5];
+    if (read_all(fd, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    *type = (char)header[0];
+    *len = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) |
+           ((uint32_t)header[3] << 8) | header[4];
+    if (*len > FRAME_MAX) {
+        return -1;
+    }
+    *payload = (char *)malloc((size_t)*len + 1);
+    if (!*payload) {
+        return -1;
+    }
+    if (read_all(fd, *payload, *len) == -1) {
+        free(*payload);
+        return -1;
+    }
+    (*payload)[*len] = '\0';
+    return 0;
+}
+
+// Run one batch in a forked copy of the warm server state and stream its
+// stdout and stderr back as frames, followed by the exit status
+static int serve_batch(ShellContext *ctx, int client_fd, const char *script) {
+    int out_pipe[2], err_pipe[2];
+    if (pipe(out_pipe) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    if (pipe(err_pipe) == -1) {
+        perror("pipe");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(out_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(err_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // Events still in the ring are written once here, not again by the
+    // batch child
+    shell_flush(ctx);
+    trace_flush(ctx);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        for (int i = 0; i < 2; i++) {
+            close(out_pipe[i]);
+            close(err_pipe[i]);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        close(client_fd);
+        // Only the server itself ignores SIGPIPE
+        signal(SIGPIPE, SIG_DFL);
+        // The session copy simply gets the pipes as its stdout and stderr
+        ctx->fds[STDIN_FILENO] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        ctx->fds[STDOUT_FILENO] = out_pipe[1];
+        ctx->fds[STDERR_FILENO] = err_pipe[1];
+        ctx->out_is_tty = 0;
+        ctx->script_input = NULL;
+        trace_forked(ctx);
+        int status = run_script(ctx, script);
+        trace_flush(ctx);
+        _exit(status & 0xff);
+    }
+
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    struct pollfd fds[2];
+    fds[0].fd = out_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = err_pipe[0];
+    fds[1].events = POLLIN;
+    int open_count = 2;
+    int failed = 0;
+    char chunk[65536];
+
+    while (open_count > 0) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd == -1 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_count--;
+                continue;
+            }
+            // Keep draining the child even if the client went away
+            if (!failed && send_frame(client_fd, i == 0 ? FRAME_STDOUT : FRAME_STDERR,
+                                      chunk, (uint32_t)n) == -1) {
+                failed = 1;
+            }
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    int exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    char payload[4];
+    payload[0] = (char)((uint32_t)exit_code >> 24);
+    payload[1] = (char)((uint32_t)exit_code >> 16);
+    payload[2] = (char)((uint32_t)exit_code >> 8);
+    payload[3] = (char)exit_code;
+    if (failed || send_frame(client_fd, FRAME_EXIT, payload, sizeof(payload)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// A connection may send any number of batches; each one runs in its own
+// session, so variables and cwd never leak between batches or clients.
+static void serve_connection(ShellContext *ctx, int client_fd) {
+    char type;
+    char *script;
+    uint32_t len;
+    while (recv_frame(client_fd, &type, &script, &len) == 0) {
+        int result = serve_batch(ctx, client_fd, script);
+        free(script);
+        if (result == -1) {
+            break;
+        }
+    }
+}
+
+static int open_server_socket(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 128) == -1) {
+        perror(socket_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Keep a warm shell listening on a Unix socket. The optional init file is
+// run once up front so every session starts from its variables.
+int run_server(ShellContext *ctx, const char *socket_path, const char *init_file) {
+    if (init_file) {
+        FILE *init = fopen(init_file, "r");
+        if (!init) {
+            perror(init_file);
+            return 1;
+        }
+        char *text = NULL;
+        size_t text_size = 0;
+        ssize_t text_len = getdelim(&text, &text_size, '\0', init);
+        fclose(init);
+        if (text_len > 0) {
+            run_script(ctx, text);
+        }
+        free(text);
+        ctx->exit_requested = 0;
+        // Written once here rather than by every connection's copy
+        trace_flush(ctx);
+    }
+
+    int listen_fd = open_server_socket(socket_path);
+    if (listen_fd == -1) {
+        return 1;
+    }
+
+    // Connection handlers are reaped automatically
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listen_fd);
+            signal(SIGCHLD, SIG_DFL);
+            serve_connection(ctx, client_fd);
+            close(client_fd);
+            _exit(0);
+        }
+        if (pid == -1) {
+            perror("fork");
+        }
+        close(client_fd);
+    }
+
+    close(listen_fd);
+    return 1;
+}
+
+// Send stdin as one batch to a server and replay its output
+int run_client(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", socket_path);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(socket_path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    char *text = NULL;
+    size_t text_size = 0;
+    ssize_t text_len = getdelim(&text, &text_size, '\0', stdin);
+    if (text_len < 0) {
+        text_len = 0;
+    }
+    if (text_len > FRAME_MAX) {
+        fprintf(stderr, "%s: script too large\n", socket_path);
+        free(text);
+        close(fd);
+        return 1;
+    }
+    if (send_frame(fd, 'b', text ? text : "", (uint32_t)text_len) == -1) {
+        perror("send");
+        free(text);
+        close(fd);
+        return 1;
+    }
+    free(text);
+
+    int status = 1;
+    char type;
+    char *payload;
+    uint32_t len;
+    while (recv_frame(fd, &type, &payload, &len) == 0) {
+        if (type == FRAME_STDOUT) {
+            write_all(STDOUT_FILENO, payload, len);
+        } else if (type == FRAME_STDERR) {
+            write_all(STDERR_FILENO, payload, len);
+        } else if (type == FRAME_EXIT && len == 4) {
+            unsigned char *p = (unsigned char *)payload;
+            status = (int)(((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+                           ((uint32_t)p[2] << 8) | p[3]);
+            free(payload);
+            break;
+        }
+        free(payload);
+    }
+    close(fd);
+    return status;
+}
+
+// Command history
+// Address of byte off of the log (the mapped file followed by added)
+static const char *history_text(History *h, size_t off) {
+    return off < h->map_len ? h->map + off : h->added.data + (off - h->map_len);
+}
+
+static HistoryEntry *history_at(History *h, int i) {
+    return &h->entries[(h->first + i) % HISTORY_SIZE];
+}
+
+// Index another entry as the newest, dropping the oldest when full
+static void history_push(History *h, size_t off, size_t len) {
+    if (h->count == HISTORY_SIZE) {
+        h->first = (h->first + 1) % HISTORY_SIZE;
+        h->count--;
+        h->base++;
+    }
+    HistoryEntry *entry = history_at(h, h->count++);
+    entry->off = off;
+    entry->len = len;
+}
+
+// Turn a stored entry back into the command (newline + tab -> newline)
+static char *history_decode(const char *text, size_t len) {
+    StrBuf sb = {NULL, 0, 0};
+    sb_append(&sb, "", 0);
+    const char *end = text + len;
+    while (text < end) {
+        const char *newline = (const char *)memchr(text, '\n', end - text);
+        if (!newline) {
+            sb_append(&sb, text, end - text);
+            break;
+        }
+        sb_append(&sb, text, newline - text + 1);
+        text = newline + 1;
+        if (text < end && *text == '\t') {
+            text++;
+        }
+    }
+    return sb.data;
+}
+
+// Start keeping history, saved to path (or only in memory when path is
+// NULL or cannot be opened). Only the tail of the log is read: entries
+// are found by walking back from the end of the mapping.
+int shell_history_open(ShellContext *ctx, const char *path) {
+    History *h = &ctx->history;
+    h->enabled = 1;
+    if (!h->entries) {
+        h->entries = (HistoryEntry *)malloc(HISTORY_SIZE * sizeof(HistoryEntry));
+        if (!h->entries) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    h->base = 1;
+    if (!path) {
+        return -1;
+    }
+    h->fd = openat(ctx->cwd_fd, path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (h->fd == -1) {
+        shell_perror(ctx, path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(h->fd, &st) == -1 || st.st_size == 0) {
+        return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    h->map = (char *)map;
+    h->map_len = st.st_size;
+    h->torn = h->map[h->map_len - 1] != '\n';
+
+    // Collect up to HISTORY_SIZE entries, newest first, into the top of the
+    // ring, then rotate so the oldest one found is at index 0
+    size_t end = h->map_len - !h->torn;
+    int found = 0;
+    while (end > 0 && found < HISTORY_SIZE) {
+        size_t start = end;
+        while (start > 0 && !(h->map[start - 1] == '\n' && h->map[start] != '\t')) {
+            start--;
+        }
+        if (end > start) {
+            HistoryEntry *entry = &h->entries[HISTORY_SIZE - 1 - found++];
+            entry->off = start;
+            entry->len = end - start;
+        }
+        end = start > 0 ? start - 1 : 0;
+    }
+    h->first = HISTORY_SIZE - found;
+    h->count = found;
+    return 0;
+}
+
+void history_close(ShellContext *ctx) {
+    History *h = &ctx->history;
+    if (h->map) {
+        munmap(h->map, h->map_len);
+    }
+    if (h->fd != -1) {
+        close(h->fd);
+    }
+    free(h->added.data);
+    free(h->entries);
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+}
+
+// Record a complete command. Leading blanks are dropped and repeats of
+// the previous entry are skipped.
+void history_add(ShellContext *ctx, const char *entry) {
+    History *h = &ctx->history;
+    entry += strspn(entry, " \t");
+    if (*entry == '\0') {
+        return;
+    }
+    StrBuf line = {NULL, 0, 0};
+    if (h->torn) {
+        // Finish a line some earlier writer left incomplete
+        sb_append(&line, "\n", 1);
+        h->torn = 0;
+    }
+    size_t text_start = line.len;
+    for (const char *p = entry; *p; p++) {
+        sb_append(&line, p, 1);
+        if (*p == '\n') {
+            sb_append(&line, "\t", 1);
+        }
+    }
+    size_t text_len = line.len - text_start;
+    if (h->count > 0) {
+        HistoryEntry *last = history_at(h, h->count - 1);
+        if (last->len == text_len &&
+            memcmp(history_text(h, last->off), line.data + text_start, text_len) == 0) {
+            free(line.data);
+            return;
+        }
+    }
+    sb_append(&line, "\n", 1);
+
+    // One write per entry, so concurrent sessions never split a line
+    if (h->fd != -1 && write_all(h->fd, line.data, line.len) == -1) {
+        shell_perror(ctx, "history");
+    }
+    size_t off = h->map_len + h->added.len;
+    sb_append(&h->added, line.data + text_start, text_len + 1);
+    history_push(h, off, text_len);
+    free(line.data);
+}
+
+// Entry number (as listed by history), or NULL when there is none
+char *history_get(ShellContext *ctx, int number) {
+    History *h = &ctx->history;
+    int i = number - h->base;
+    if (i < 0 || i >= h->count) {
+        return NULL;
+    }
+    HistoryEntry *entry = history_at(h, i);
+    return history_decode(history_text(h, entry->off), entry->len);
+}
+
+// Last occurrence of query in text[0..len). The text is taken in blocks
+// from the end, each scanned forward with memchr for the first byte, so
+// a recent match is found without reading the whole log.
+static const char *find_last(const char *text, size_t len, const char *query, size_t query_len) {
+    size_t block = HISTORY_SEARCH_BLOCK > query_len ? HISTORY_SEARCH_BLOCK : query_len * 2;
+    size_t end = len;
+    while (end >= query_len) {
+        size_t start = end > block ? end - block : 0;
+        const char *p = text + start;
+        const char *limit = text + end - query_len + 1;
+        const char *last = NULL;
+        while (p < limit && (p = (const char *)memchr(p, query[0], limit - p)) != NULL) {
+            if (memcmp(p, query, query_len) == 0) {
+                last = p;
+            }
+            p++;
+        }
+        if (last) {
+            return last;
+        }
+        if (start == 0) {
+            break;
+        }
+        // Overlap so a match across the block boundary is not missed
+        end = start + query_len - 1;
+    }
+    return NULL;
+}
+
+// Reverse search: the newest entry containing query that lies wholly
+// before offset before of the log. The whole log is searched, not just
+// the indexed entries. Returns the entry's offset, or -1.
+static long history_search(History *h, const char *query, size_t before, size_t *entry_len) {
+    size_t query_len = strlen(query);
+    if (query_len == 0) {
+        return -1;
+    }
+    // The added entries first, then the mapped file
+    for (int segment = 1; segment >= 0; segment--) {
+        const char *text = segment ? h->added.data : h->map;
+        size_t seg_start = segment ? h->map_len : 0;
+        size_t seg_len = segment ? h->added.len : h->map_len;
+        if (!text || before <= seg_start) {
+            continue;
+        }
+        size_t scan_len = before - seg_start < seg_len ? before - seg_start : seg_len;
+        const char *match = find_last(text, scan_len, query, query_len);
+        while (match) {
+            size_t start = match - text;
+            while (start > 0 && !(text[start - 1] == '\n' && text[start] != '\t')) {
+                start--;
+            }
+            size_t end = match - text;
+            while (end < seg_len && !(text[end] == '\n' && (end + 1 >= seg_len || text[end + 1] != '\t'))) {
+                end++;
+            }
+            if ((size_t)(match - text) + query_len <= end) {
+                *entry_len = end - start;
+                return (long)(seg_start + start);
+            }
+            // Runs into the next entry: keep looking further back
+            match = find_last(text, match - text + query_len - 1, query, query_len);
+        }
+    }
+    return -1;
+}
+
+// history [-c] [N]: list the last N entries (all by default)
+int history_builtin(ShellContext *ctx, char **args, int arg_count) {
+    History *h = &ctx->history;
+    if (arg_count > 1 && strcmp(args[1], "-c") == 0) {
+        h->base += h->count;
+        h->count = 0;
+        return 0;
+    }
+    int shown = h->count;
+    if (arg_count > 1) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end != '\0' || n < 0) {
+            shell_printf(ctx, STDERR_FILENO, "history: %s: numeric argument required\n", args[1]);
+            return 1;
+        }
+        if (n < shown) {
+            shown = (int)n;
+        }
+    }
+    for (int i = h->count - shown; i < h->count; i++) {
+        char *text = history_get(ctx, h->base + i);
+        shell_printf(ctx, STDOUT_FILENO, "%5d  %s\n", h->base + i, text);
+        free(text);
+    }
+    return 0;
+}
+
+// The entry a "!" reference names: !! (previous), !N, !-N or !prefix
+static char *history_event(ShellContext *ctx, const char *event, size_t len) {
+    History *h = &ctx->history;
+    if (len == 1 && event[0] == '!') {
+        return history_get(ctx, h->base + h->count - 1);
+    }
+    if (isdigit((unsigned char)event[0])) {
+        return history_get(ctx, atoi(event));
+    }
+    if (event[0] == '-') {
+        return history_get(ctx, h->base + h->count - atoi(event + 1));
+    }
+    for (int i = h->count - 1; i >= 0; i--) {
+        HistoryEntry *entry = history_at(h, i);
+        if (entry->len >= len && memcmp(history_text(h, entry->off), event, len) == 0) {
+            return history_decode(history_text(h, entry->off), entry->len);
+        }
+    }
+    return NULL;
+}
+
+// Replace "!" references in line with the entries they name. Nothing is
+// expanded inside single quotes or after a backslash, and a "!" followed
+// by a blank, "=", "(", a quote or an operator names no event and is left
+// alone. Returns the new line, or NULL after reporting an unknown event.
+char *history_expand(ShellContext *ctx, const char *line, int *expanded) {
+    StrBuf sb = {NULL, 0, 0};
+    sb_append(&sb, "", 0);
+    int in_single = 0;
+    int in_double = 0;
+    const char *p = line;
+    while (*p) {
+        if (*p == '\\' && !in_single && p[1]) {
+            sb_append(&sb, p, 2);
+            p += 2;
+            continue;
+        }
+        if (*p == '\'' && !in_double) {
+            in_single = !in_single;
+        } else if (*p == '"' && !in_single) {
+            in_double = !in_double;
+        }
+        if (*p != '!' || in_single || p[1] == '\0' || strchr(" \t\n=(;&|<>\"'", p[1])) {
+            sb_append(&sb, p, 1);
+            p++;
+            continue;
+        }
+
+        const char *event = p + 1;
+        size_t len;
+        if (*event == '!') {
+            len = 1;
+        } else if (isdigit((unsigned char)*event) || (*event == '-' && isdigit((unsigned char)event[1]))) {
+            len = 1;
+            while (isdigit((unsigned char)event[len])) {
+                len++;
+            }
+        } else {
+            len = strcspn(event, " \t\n;&|<>\"'");
+        }
+        char *text = history_event(ctx, event, len);
+        if (!text) {
+            shell_printf(ctx, STDERR_FILENO, "!%.*s: event not found\n", (int)len, event);
+            free(sb.data);
+            return NULL;
+        }
+        sb_append(&sb, text, strlen(text));
+        free(text);
+        *expanded = 1;
+        p = event + len;
+    }
+    return sb.data;
+}
+
+// Interactive line editing
+// Prefix trie of every executable on PATH plus the builtins. Children are
+// kept sorted by byte so completions come out in order.
+typedef struct TrieNode {
+    unsigned char *keys;
+    struct TrieNode **children;
+    int child_count;
+    int terminal;
+} TrieNode;
+
+static TrieNode *trie_new() {
+    TrieNode *node = (TrieNode *)calloc(1, sizeof(TrieNode));
+    if (!node) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    return node;
+}
+
+static void trie_free(TrieNode *node) {
+    if (!node) {
+        return;
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        trie_free(node->children[i]);
+    }
+    free(node->keys);
+    free(node->children);
+    free(node);
+}
+
+// Binary search for the child under key; *slot gets the insert position
+static TrieNode *trie_child(TrieNode *node, unsigned char key, int *slot) {
+    int lo = 0, hi = node->child_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (node->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (slot) {
+        *slot = lo;
+    }
+    return lo < node->child_count && node->keys[lo] == key ? node->children[lo] : NULL;
+}
+
+static void trie_insert(TrieNode *node, const char *word) {
+    for (const unsigned char *p = (const unsigned char *)word; *p; p++) {
+        int slot;
+        TrieNode *child = trie_child(node, *p, &slot);
+        if (!child) {
+            child = trie_new();
+            node->keys = (unsigned char *)realloc(node->keys, node->child_count + 1);
+            node->children = (TrieNode **)realloc(node->children,
+                                                  (node->child_count + 1) * sizeof(TrieNode *));
+            memmove(node->keys + slot + 1, node->keys + slot, node->child_count - slot);
+            memmove(node->children + slot + 1, node->children + slot,
+                    (node->child_count - slot) * sizeof(TrieNode *));
+            node->keys[slot] = *p;
+            node->children[slot] = child;
+            node->child_count++;
+        }
+        node = child;
+    }
+    node->terminal = 1;
+}
+
+static TrieNode *trie_find(TrieNode *node, const char *prefix) {
+    for (const unsigned char *p = (const unsigned char *)prefix; *p && node; p++) {
+        node = trie_child(node, *p, NULL);
+    }
+    return node;
+}
+
+// Collect up to max words below node (each prefixed by word[0..len))
+static void trie_collect(TrieNode *node, StrBuf *word, char ***out, int *count, int max) {
+    if (*count >= max) {
+        return;
+    }
+    if (node->terminal) {
+        (*out)[(*count)++] = strdup(word->data);
+    }
+    for (int i = 0; i < node->child_count && *count < max; i++) {
+        char key = (char)node->keys[i];
+        sb_append(word, &key, 1);
+        trie_collect(node->children[i], word, out, count, max);
+        word->data[--word->len] = '\0';
+    }
+}
+
+// The trie is rebuilt lazily: only when PATH itself changes or one of its
+// directories has a new mtime (something was installed or removed).
+typedef struct {
+    char *path_value;
+    char **dirs;
+    struct timespec *mtimes;
+    int dir_count;
+    TrieNode *root;
+} PathCache;
 
+// Front-end state: only the interactive line editor (one per process,
+// on the terminal's thread) completes commands, so the cache is not kept
+// per session like everything else
+static PathCache path_cache = {NULL, NULL, NULL, 0, NULL};
+
+static const char *BUILTIN_NAMES[] = {
+    "cat", "cd", "echo", "exit", "export", "history", "pwd", "read", "set", "timeout",
+    "break", "continue", "if", "then", "elif", "else", "fi", "for", "while",
+    "until", "do", "done", NULL
+};
+
+static const char *current_path(ShellContext *ctx) {
+    const char *path = get_var_value(ctx, "PATH");
+    if (!path) {
+        path = getenv("PATH");
+    }
+    return path ? path : "/usr/bin:/bin";
+}
+
+static int path_cache_stale(const char *path) {
+    if (!path_cache.root || strcmp(path_cache.path_value, path) != 0) {
+        return 1;
+    }
+    for (int i = 0; i < path_cache.dir_count; i++) {
+        struct stat st;
+        if (stat(path_cache.dirs[i], &st) == -1) {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        if (st.st_mtim.tv_sec != path_cache.mtimes[i].tv_sec ||
+            st.st_mtim.tv_nsec != path_cache.mtimes[i].tv_nsec) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void path_cache_rebuild(const char *path) {
+    trie_free(path_cache.root);
+    for (int i = 0; i < path_cache.dir_count; i++) {
+        free(path_cache.dirs[i]);
+    }
+    free(path_cache.dirs);
+    free(path_cache.mtimes);
+    free(path_cache.path_value);
+
+    path_cache.path_value = strdup(path);
+    path_cache.root = trie_new();
+    path_cache.dir_count = 0;
+    path_cache.dirs = NULL;
+    path_cache.mtimes = NULL;
+    for (int i = 0; BUILTIN_NAMES[i]; i++) {
+        trie_insert(path_cache.root, BUILTIN_NAMES[i]);
+    }
+
+    char *copy = strdup(path);
+    char *save = NULL;
+    for (char *dir = strtok_r(copy, ":", &save); dir; dir = strtok_r(NULL, ":", &save)) {
+        path_cache.dirs = (char **)realloc(path_cache.dirs, (path_cache.dir_count + 1) * sizeof(char *));
+        path_cache.mtimes = (struct timespec *)realloc(path_cache.mtimes,
+                                                       (path_cache.dir_count + 1) * sizeof(struct timespec));
+        struct stat st;
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1 || fstat(dir_fd, &st) == -1) {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        path_cache.dirs[path_cache.dir_count] = strdup(dir);
+        path_cache.mtimes[path_cache.dir_count] = st.st_mtim;
+        path_cache.dir_count++;
+        if (dir_fd == -1) {
+            continue;
+        }
+
+        DIR *listing = fdopendir(dir_fd);
+        if (!listing) {
+            close(dir_fd);
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(listing)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) {
+                continue;
+            }
+            if (faccessat(dir_fd, entry->d_name, X_OK, 0) == 0) {
+                trie_insert(path_cache.root, entry->d_name);
+            }
+        }
+        closedir(listing);
+    }
+    free(copy);
+}
+
+// Complete a command name; fills *out with up to max matches
+static int complete_command(ShellContext *ctx, const char *prefix, char ***out, int max) {
+    const char *path = current_path(ctx);
+    if (path_cache_stale(path)) {
+        path_cache_rebuild(path);
+    }
+    *out = (char **)malloc(max * sizeof(char *));
+    int count = 0;
+    TrieNode *node = trie_find(path_cache.root, prefix);
+    if (node) {
+        StrBuf word = {NULL, 0, 0};
+        sb_append(&word, prefix, strlen(prefix));
+        trie_collect(node, &word, out, &count, max);
+        free(word.data);
+    }
+    return count;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Complete a file name (relative to the session's directory); directories
+// get a trailing '/'
+static int complete_path(ShellContext *ctx, const char *prefix, char ***out, int max) {
+    const char *slash = strrchr(prefix, '/');
+    char *dir = slash ? strndup(prefix, slash - prefix + 1) : strdup(".");
+    const char *base = slash ? slash + 1 : prefix;
+    size_t base_len = strlen(base);
+
+    *out = (char **)malloc(max * sizeof(char *));
+    int count = 0;
+    int dir_fd = openat(ctx->cwd_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *listing = dir_fd == -1 ? NULL : fdopendir(dir_fd);
+    if (!listing && dir_fd != -1) {
+        close(dir_fd);
+    }
+    if (listing) {
+        struct dirent *entry;
+        while ((entry = readdir(listing)) != NULL && count < max) {
+            const char *name = entry->d_name;
+            if (strncmp(name, base, base_len) != 0 || strcmp(name, ".") == 0 ||
+                strcmp(name, "..") == 0 || (name[0] == '.' && base[0] != '.')) {
+                continue;
+            }
+            int is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                struct stat st;
+                is_dir = fstatat(dirfd(listing), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+            size_t dir_len = slash ? strlen(dir) : 0;
+            char *match = (char *)malloc(dir_len + strlen(name) + 2);
+            sprintf(match, "%s%s%s", slash ? dir : "", name, is_dir ? "/" : "");
+            (*out)[count++] = match;
+        }
+        closedir(listing);
+    }
+    free(dir);
+    qsort(*out, count, sizeof(char *), compare_strings);
+    return count;
+}
+
+typedef struct {
+    ShellContext *ctx;
+    StrBuf line;
+    size_t cursor;
+    const char *prompt;
+    int last_key_tab;
+} LineState;
+
+static void refresh_line(LineState *ls) {
+    StrBuf out = {NULL, 0, 0};
+    char move[32];
+    sb_append(&out, "\r", 1);
+    sb_append(&out, ls->prompt, strlen(ls->prompt));
+    sb_append(&out, ls->line.data, ls->line.len);
+    sb_append(&out, "\x1b[K\r", 4);
+    size_t column = strlen(ls->prompt) + ls->cursor;
+    if (column > 0) {
+        snprintf(move, sizeof(move), "\x1b[%zuC", column);
+        sb_append(&out, move, strlen(move));
+    }
+    write_all(STDOUT_FILENO, out.data, out.len);
+    free(out.data);
+}
+
+static void line_set(LineState *ls, const char *text) {
+    ls->line.len = 0;
+    sb_append(&ls->line, text, strlen(text));
+    ls->cursor = ls->line.len;
+}
+
+static void line_insert(LineState *ls, const char *text, size_t len) {
+    size_t tail = ls->line.len - ls->cursor;
+    sb_append(&ls->line, text, len);   // grow; contents fixed up below
+    memmove(ls->line.data + ls->cursor + len, ls->line.data + ls->cursor, tail);
+    memcpy(ls->line.data + ls->cursor, text, len);
+    ls->cursor += len;
+}
+
+static void line_delete(LineState *ls, size_t from, size_t to) {
+    memmove(ls->line.data + from, ls->line.data + to, ls->line.len - to + 1);
+    ls->line.len -= to - from;
+    if (ls->cursor > to) {
+        ls->cursor -= to - from;
+    } else if (ls->cursor > from) {
+        ls->cursor = from;
+    }
+}
+
+static void complete_line(LineState *ls) {
+    // The word under completion runs back from the cursor to a blank
+    size_t start = ls->cursor;
+    while (start > 0 && ls->line.data[start - 1] != ' ' && ls->line.data[start - 1] != '\t') {
+        start--;
+    }
+    // It names a command when nothing but an operator comes before it
+    size_t before = start;
+    while (before > 0 && (ls->line.data[before - 1] == ' ' || ls->line.data[before - 1] == '\t')) {
+        before--;
+    }
+    int command_position = before == 0 || strchr(";&|", ls->line.data[before - 1]) != NULL;
+
+    char *prefix = strndup(ls->line.data + start, ls->cursor - start);
+    char **matches = NULL;
+    int count;
+    if (command_position && !strchr(prefix, '/')) {
+        count = complete_command(ls->ctx, prefix, &matches, MAX_COMPLETIONS_SHOWN + 1);
+    } else {
+        count = complete_path(ls->ctx, prefix, &matches, MAX_COMPLETIONS_SHOWN + 1);
+    }
+
+    if (count > 0) {
+        // Extend to the longest prefix all matches share
+        size_t common = strlen(matches[0]);
+        for (int i = 1; i < count; i++) {
+            size_t j = 0;
+            while (j < common && matches[i][j] == matches[0][j]) {
+                j++;
+            }
+            common = j;
+        }
+        size_t prefix_len = strlen(prefix);
+        if (common > prefix_len) {
+            line_insert(ls, matches[0] + prefix_len, common - prefix_len);
+        }
+        if (count == 1 && matches[0][common - 1] != '/') {
+            line_insert(ls, " ", 1);
+        }
+        if (count > 1 && common == prefix_len && ls->last_key_tab) {
+            // Second Tab without progress: list the candidates
+            StrBuf list = {NULL, 0, 0};
+            sb_append(&list, "\r\n", 2);
+            for (int i = 0; i < count && i < MAX_COMPLETIONS_SHOWN; i++) {
+                sb_append(&list, matches[i], strlen(matches[i]));
+                sb_append(&list, "  ", 2);
+            }
+            if (count > MAX_COMPLETIONS_SHOWN) {
+                sb_append(&list, "...", 3);
+            }
+            sb_append(&list, "\r\n", 2);
+            write_all(STDOUT_FILENO, list.data, list.len);
+            free(list.data);
+        }
+    }
+    if (count != 1 && !(count > 1 && ls->last_key_tab)) {
+        write_all(STDOUT_FILENO, "\a", 1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(matches[i]);
+    }
+    free(matches);
+    free(prefix);
+}
+
+// Ctrl-R: incremental search back through the whole history log. Typing
+// narrows the search, Ctrl-R again moves to the next older match and
+// Ctrl-G or Ctrl-C restores the line. Enter runs the match (returns 1);
+// any other control key keeps it for editing (returns 0).
+static int reverse_search(LineState *ls) {
+    History *h = &ls->ctx->history;
+    StrBuf query = {NULL, 0, 0};
+    sb_append(&query, "", 0);
+    char *original = strdup(ls->line.data);
+    size_t log_end = h->map_len + h->added.len;
+    long match = -1;
+    size_t match_len = 0;
+    int failed = 0;
+    int submit = 0;
+
+    while (1) {
+        StrBuf out = {NULL, 0, 0};
+        sb_append(&out, "\r", 1);
+        if (failed) {
+            sb_append(&out, "(failed ", 8);
+        } else {
+            sb_append(&out, "(", 1);
+        }
+        sb_append(&out, "reverse-i-search)`", 18);
+        sb_append(&out, query.data, query.len);
+        sb_append(&out, "': ", 3);
+        sb_append(&out, ls->line.data, ls->line.len);
+        sb_append(&out, "\x1b[K", 3);
+        write_all(STDOUT_FILENO, out.data, out.len);
+        free(out.data);
+
+        char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size_t before;
+        if (c == 18) {                  // Ctrl-R: older match
+            before = match >= 0 ? (size_t)match : log_end;
+        } else if (c == 127 || c == 8) {
+            if (query.len > 0) {
+                query.data[--query.len] = '\0';
+            }
+            before = log_end;
+        } else if (c == 7 || c == 3) {  // Ctrl-G / Ctrl-C
+            line_set(ls, original);
+            break;
+        } else if (c == '\r' || c == '\n') {
+            submit = 1;
+            break;
+        } else if ((unsigned char)c >= 32) {
+            sb_append(&query, &c, 1);
+            // The current match may still match the longer query
+            before = match >= 0 ? (size_t)match + match_len : log_end;
+        } else {
+            break;
+        }
+
+        // Multi-line entries do not fit the editor: look further back
+        size_t found_len;
+        char *text = NULL;
+        long found = history_search(h, query.data, before, &found_len);
+        while (found >= 0) {
+            text = history_decode(history_text(h, found), found_len);
+            if (!strchr(text, '\n')) {
+                break;
+            }
+            free(text);
+            text = NULL;
+            found = history_search(h, query.data, (size_t)found, &found_len);
+        }
+        failed = found < 0 && query.len > 0;
+        if (found >= 0) {
+            match = found;
+            match_len = found_len;
+            line_set(ls, text);
+            free(text);
+        } else if (query.len == 0) {
+            match = -1;
+            line_set(ls, original);
+        }
+    }
+    free(query.data);
+    free(original);
+    return submit;
+}
+
+// The next byte of an escape sequence, if one comes within
+// ESCAPE_TIMEOUT_MS; a lone ESC must not wait for further keys
+static int read_escape_byte(char *c) {
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    int ready;
+    do {
+        ready = poll(&pfd, 1, ESCAPE_TIMEOUT_MS);
+    } while (ready == -1 && errno == EINTR);
+    return ready == 1 && read(STDIN_FILENO, c, 1) == 1;
+}
+
+// Read one line from the terminal in raw mode. Behaves like getline()
+// minus the newline: returns the length, or -1 at end of input.
+ssize_t line_edit(ShellContext *ctx, const char *prompt, char **buffer, size_t *buffer_size) {
+    struct termios original, raw;
+    shell_flush(ctx);
+    if (tcgetattr(STDIN_FILENO, &original) == -1) {
+        printf("%s", prompt);
+        fflush(stdout);
+        return getline(buffer, buffer_size, stdin);
+    }
+    raw = original;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+    LineState ls;
+    ls.ctx = ctx;
+    ls.line.data = NULL;
+    ls.line.len = 0;
+    ls.line.cap = 0;
+    sb_append(&ls.line, "", 0);
+    ls.cursor = 0;
+    ls.prompt = prompt;
+    ls.last_key_tab = 0;
+    int history_index = ctx->history.count;
+    char *pending_edit = NULL;  // the new line while browsing history
+    ssize_t result = 0;
+
+    refresh_line(&ls);
+    while (1) {
+        char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            result = -1;
+            break;
+        }
+        int was_tab = ls.last_key_tab;
+        ls.last_key_tab = 0;
+
+        if (c == '\r' || c == '\n') {
+            break;
+        } else if (c == 4) {            // Ctrl-D
+            if (ls.line.len == 0) {
+                result = -1;
+                break;
+            }
+            if (ls.cursor < ls.line.len) {
+                line_delete(&ls, ls.cursor, ls.cursor + 1);
+            }
+        } else if (c == 3) {            // Ctrl-C: drop the line
+            write_all(STDOUT_FILENO, "^C\r\n", 4);
+            line_set(&ls, "");
+        } else if (c == 18) {           // Ctrl-R
+            if (reverse_search(&ls)) {
+                break;
+            }
+        } else if (c == 127 || c == 8) {
+            if (ls.cursor > 0) {
+                line_delete(&ls, ls.cursor - 1, ls.cursor);
+            }
+        } else if (c == '\t') {
+            ls.last_key_tab = was_tab;
+            complete_line(&ls);
+            ls.last_key_tab = 1;
+        } else if (c == 1) {            // Ctrl-A
+            ls.cursor = 0;
+        } else if (c == 5) {            // Ctrl-E
+            ls.cursor = ls.line.len;
+        } else if (c == 11) {           // Ctrl-K
+            line_delete(&ls, ls.cursor, ls.line.len);
+        } else if (c == 21) {           // Ctrl-U
+            line_delete(&ls, 0, ls.cursor);
+        } else if (c == 12) {           // Ctrl-L
+            write_all(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        } else if (c == 27) {
+            char seq[3];
+            if (!read_escape_byte(&seq[0]) || !read_escape_byte(&seq[1])) {
+                continue;
+            }
+            if (seq[0] != '[' && seq[0] != 'O') {
+                continue;
+            }
+            if (seq[1] >= '0' && seq[1] <= '9') {
+                // ESC [ n ~ (Home/End/Delete on some terminals)
+                if (!read_escape_byte(&seq[2]) || seq[2] != '~') {
+                    continue;
+                }
+                if (seq[1] == '3' && ls.cursor < ls.line.len) {
+                    line_delete(&ls, ls.cursor, ls.cursor + 1);
+                } else if (seq[1] == '1' || seq[1] == '7') {
+                    ls.cursor = 0;
+                } else if (seq[1] == '4' || seq[1] == '8') {
+                    ls.cursor = ls.line.len;
+                }
+            } else if (seq[1] == 'A' || seq[1] == 'B') {
+                // History: Up goes back, Down forward to the line being
+                // typed. Multi-line entries are skipped: they do not fit
+                // the single-line editor.
+                int step = seq[1] == 'A' ? -1 : 1;
+                int next = history_index + step;
+                char *text = NULL;
+                while (next >= 0 && next < ctx->history.count) {
+                    text = history_get(ctx, ctx->history.base + next);
+                    if (!strchr(text, '\n')) {
+                        break;
+                    }
+                    free(text);
+                    text = NULL;
+                    next += step;
+                }
+                if (next < 0 || next > ctx->history.count) {
+                    continue;
+                }
+                if (history_index == ctx->history.count) {
+                    free(pending_edit);
+                    pending_edit = strdup(ls.line.data);
+                }
+                history_index = next;
+                if (next == ctx->history.count) {
+                    line_set(&ls, pending_edit);
+                } else {
+                    line_set(&ls, text);
+                    free(text);
+                }
+            } else if (seq[1] == 'C' && ls.cursor < ls.line.len) {
+                ls.cursor++;
+            } else if (seq[1] == 'D' && ls.cursor > 0) {
+                ls.cursor--;
+            } else if (seq[1] == 'H') {
+                ls.cursor = 0;
+            } else if (seq[1] == 'F') {
+                ls.cursor = ls.line.len;
+            }
+        } else if ((unsigned char)c >= 32) {
+            line_insert(&ls, &c, 1);
+        }
+        refresh_line(&ls);
+    }
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &original);
+    write_all(STDOUT_FILENO, "\r\n", 2);
+    free(pending_edit);
+
+    if (result != -1) {
+        if (*buffer_size < ls.line.len + 1) {
+            *buffer_size = ls.line.len + 1;
+            *buffer = (char *)realloc(*buffer, *buffer_size);
+        }
+        memcpy(*buffer, ls.line.data, ls.line.len + 1);
+        result = ls.line.len;
+    }
+    free(ls.line.data);
+    return result;
+}
@@ -1,14 +1,171 @@
 #include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+// Open parent directories kept around while moving a batch of sources
+#define DIR_CACHE_SIZE 64
+
+typedef struct {
+    char *path;
+    int fd;
+} CachedDir;
+
+static CachedDir dir_cache[DIR_CACHE_SIZE];
+
+static unsigned long hash_path(const char *path) {
+    unsigned long hash = 5381;
+    while (*path) {
+        hash = hash * 33 + (unsigned char)*path++;
+    }
+    return hash;
+}
+
+static void clear_dir_cache() {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (dir_cache[i].path) {
+            free(dir_cache[i].path);
+            close(dir_cache[i].fd);
+            dir_cache[i].path = NULL;
+        }
+    }
+}
+
+// Return an fd for a parent directory, opening it only the first
+// time it is seen. A colliding entry is simply replaced.
+static int cached_dir_fd(const char *path) {
+    CachedDir *slot = &dir_cache[hash_path(path) % DIR_CACHE_SIZE];
+    if (slot->path && strcmp(slot->path, path) == 0) {
+        return slot->fd;
+    }
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (slot->path) {
+        free(slot->path);
+        close(slot->fd);
+    }
+    slot->path = strdup(path);
+    slot->fd = fd;
+    return fd;
+}
+
+static int do_rename(int old_dir, const char *old_name, int new_dir, const char *new_name,
+                     unsigned int flags) {
+    if (syscall(SYS_renameat2, old_dir, old_name, new_dir, new_name, flags) == 0) {
+        return 0;
+    }
+    if (errno == ENOSYS && flags == 0) {
+        return renameat(old_dir, old_name, new_dir, new_name);
+    }
+    return -1;
+}
+
+// Split "a/b/c" into the parent's fd and "c". Trailing slashes are dropped
+// in place so "dir/" moves the directory itself.
+static int resolve_source(char *source, const char **name) {
+    size_t len = strlen(source);
+    while (len > 1 && source[len - 1] == '/') {
+        source[--len] = '\0';
+    }
+    char *slash = strrchr(source, '/');
+    if (!slash) {
+        *name = source;
+        return AT_FDCWD;
+    }
+    *name = slash + 1;
+    if (slash == source) {
+        return cached_dir_fd("/");
+    }
+    *slash = '\0';
+    int fd = cached_dir_fd(source);
+    *slash = '/';
+    return fd;
+}
+
 int mv_main(int argc, char *argv[]) {
     // Write your code here
     // Do not write a main() function. Instead, deal with mv_main() as the main function of your program.
-    if (argc != 3) {
-        printf("Usage: %s <source> <destination>\n", argv[0]);
+    unsigned int flags = 0;
+    int first = 1;
+    while (first < argc && argv[first][0] == '-' && argv[first][1] != '\0') {
+        if (strcmp(argv[first], "--") == 0) {
+            first++;
+            break;
+        } else if (strcmp(argv[first], "-n") == 0 || strcmp(argv[first], "--no-clobber") == 0) {
+            flags |= RENAME_NOREPLACE;
+        } else if (strcmp(argv[first], "-x") == 0 || strcmp(argv[first], "--exchange") == 0) {
+            flags |= RENAME_EXCHANGE;
+        } else {
+            printf("Usage: %s [-n] [-x] <source>... <destination>\n", argv[0]);
+            return 1;
+        }
+        first++;
+    }
+    if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) {
+        fprintf(stderr, "mv: -n and -x are mutually exclusive\n");
         return 1;
     }
-    if (rename(argv[1], argv[2]) == 0) {
-        return 0;
+    if (argc - first < 2) {
+        printf("Usage: %s [-n] [-x] <source>... <destination>\n", argv[0]);
+        return 1;
     }
-    return -1;
 
-}
\ No newline at end of file
+    char *dest = argv[argc - 1];
+    int source_count = argc - first - 1;
+    struct stat st;
+    int dest_is_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+
+    // Plain rename: one source onto a path that is not a directory, or
+    // swapping two paths (which may well be directories)
+    if (source_count == 1 && (!dest_is_dir || (flags & RENAME_EXCHANGE))) {
+        if (do_rename(AT_FDCWD, argv[first], AT_FDCWD, dest, flags) == 0) {
+            return 0;
+        }
+        fprintf(stderr, "mv: cannot move '%s' to '%s': %s\n", argv[first], dest, strerror(errno));
+        return -1;
+    }
+    if (!dest_is_dir) {
+        fprintf(stderr, "mv: target '%s' is not a directory\n", dest);
+        return -1;
+    }
+
+    // Batch move: the target directory is opened once and every source is
+    // renamed relative to it and to its own (cached) parent directory
+    int dest_fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dest_fd == -1) {
+        fprintf(stderr, "mv: cannot open '%s': %s\n", dest, strerror(errno));
+        return -1;
+    }
+    int result = 0;
+    for (int i = first; i < argc - 1; i++) {
+        const char *name;
+        int source_dir = resolve_source(argv[i], &name);
+        if (source_dir == -1) {
+            fprintf(stderr, "mv: cannot stat '%s': %s\n", argv[i], strerror(errno));
+            result = -1;
+            continue;
+        }
+        if (do_rename(source_dir, name, dest_fd, name, flags) == -1) {
+            fprintf(stderr, "mv: cannot move '%s' to '%s/%s': %s\n",
+                    argv[i], dest, name, strerror(errno));
+            result = -1;
+        }
+    }
+    close(dest_fd);
+    clear_dir_cache();
+    return result;
+
+}
@@ -0,0 +1,77 @@
+#!/bin/sh
+# Regression checks for microShell.
+# Usage: tests/microShell_test.sh path/to/microshell
+# Each case feeds a script to the shell on stdin and compares what it
+# prints, with the prompts taken out.
+
+shell=${1:?usage: $0 path/to/microshell}
+failures=0
+
+report() {
+    name=$1
+    expected=$2
+    actual=$3
+    if [ "$actual" = "$expected" ]; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        echo "  expected: $(printf '%s' "$expected" | od -c | head -3)"
+        echo "  actual:   $(printf '%s' "$actual" | od -c | head -3)"
+        failures=$((failures + 1))
+    fi
+}
+
+check() {
+    report "$1" "$3" "$(printf '%s\n' "$2" | "$shell" 2>&1 | sed 's/pico\$ //g; s/^\(> \)*//')"
+}
+
+# read with no names keeps the whole line in REPLY
+check "read REPLY keeps blanks" 'read
+   lead  and trail   
+echo "[$REPLY]"' '[   lead  and trail   ]'
+
+check "read keeps an escaped trailing space" 'read x
+a\ 
+echo "[$x]"' '[a ]'
+
+check "read splits fields" 'read x y
+  one   two  three  
+echo "[$x][$y]"' '[one][two  three]'
+
+# An assignment reports the status of its command substitution
+check "assignment keeps the substitution status" 'x=$(false)
+echo $?
+x=$(exit 3)
+echo $?
+x=1
+echo $?' '1
+3
+0'
+
+# A construct runs once its last line closes it; reserved words only
+# count where a command starts
+check "multi-line constructs run when closed" 'echo fi done
+for x in if fi
+do
+    while false; do if true; then :; fi done
+    echo $x
+done' 'fi done
+if
+fi'
+
+# History expansion only happens on a terminal, which script(1) provides.
+# A "!" that names no event stays as typed, so the history holds the lines
+# unchanged.
+if command -v script >/dev/null 2>&1; then
+    histfile=$(mktemp)
+    lines='echo one
+echo "hi!"
+echo a!;'
+    printf '%s\n' "$lines" | HISTFILE=$histfile script -qec "$shell" /dev/null >/dev/null
+    report "history keeps a ! that names no event" "$lines" "$(cat "$histfile")"
+    rm -f "$histfile"
+else
+    echo "skip history keeps a ! that names no event (no script command)"
+fi
+
+exit $failures
@@ -0,0 +1,400 @@
+// Parallel directory traversal.
+// walk_tree() visits every entry below root from a pool of threads. Each
+// thread owns a deque of directories still to be read: it pushes and pops
+// at the bottom (depth first, warm caches) while idle threads steal from
+// the top of other threads' deques. Entries are read in large batches with
+// getdents64 and typed from d_type, so nothing is stat'ed unless a caller
+// asks for it. The callbacks run concurrently on all threads.
+#ifndef WALK_H
+#define WALK_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Bytes of directory entries fetched per getdents64 call
+#define DENTS_BUFFER_SIZE (64 * 1024)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    const char *path;   // full path as given by root + names
+    const char *name;   // last component
+    int dir_fd;         // fd of the containing directory (for *at() calls)
+    unsigned char type; // DT_* value, DT_UNKNOWN if it could not be found out
+    int depth;          // 0 for root
+    int worker;         // index of the calling thread, 0..threads-1
+} WalkEntry;
+
+// Return WALK_PRUNE from the callback to skip a directory's contents
+enum { WALK_CONTINUE, WALK_PRUNE };
+
+typedef int (*WalkVisitFn)(const WalkEntry *entry, void *arg);
+// Called with the path that could not be read and the errno value
+typedef void (*WalkErrorFn)(const char *path, int error, void *arg);
+
+// An open directory shared by the subdirectories queued from it, so each
+// of them is opened relative to its parent instead of by full path. At
+// most half the fd limit (and no more than 4096) are kept open at once;
+// past that, the subdirectories of a directory are opened by full path.
+typedef struct {
+    int fd;
+    long refs;
+} WalkDir;
+
+typedef struct {
+    char *path;
+    size_t name_offset; // start of the last component in path
+    WalkDir *parent;    // NULL for root
+    int depth;
+} WalkItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    WalkItem *items;
+    size_t head;        // thieves take from here
+    size_t tail;        // the owner pushes and pops here
+    size_t cap;
+} WorkDeque;
+
+typedef struct {
+    WorkDeque *deques;
+    int threads;
+    int max_depth;      // -1 for unlimited
+    long pending;       // directories queued or being read
+    int errors;
+    long shared_dirs;   // WalkDirs kept open for queued subdirectories
+    long max_shared_dirs;
+    WalkVisitFn visit;
+    WalkErrorFn error;
+    void *arg;
+} Walker;
+
+typedef struct {
+    Walker *walker;
+    int index;
+} WorkerArgs;
+
+static unsigned char walk_mode_type(mode_t mode) {
+    if (S_ISREG(mode)) return DT_REG;
+    if (S_ISDIR(mode)) return DT_DIR;
+    if (S_ISLNK(mode)) return DT_LNK;
+    if (S_ISFIFO(mode)) return DT_FIFO;
+    if (S_ISSOCK(mode)) return DT_SOCK;
+    if (S_ISBLK(mode)) return DT_BLK;
+    if (S_ISCHR(mode)) return DT_CHR;
+    return DT_UNKNOWN;
+}
+
+static void walk_dir_release(Walker *walker, WalkDir *dir) {
+    if (dir && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(dir->fd);
+        free(dir);
+        __atomic_sub_fetch(&walker->shared_dirs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void deque_push(WorkDeque *dq, const WalkItem *item) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap) {
+        if (dq->head > 0) {
+            memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof(WalkItem));
+            dq->tail -= dq->head;
+            dq->head = 0;
+        } else {
+            dq->cap = dq->cap ? dq->cap * 2 : 64;
+            dq->items = (WalkItem *)realloc(dq->items, dq->cap * sizeof(WalkItem));
+            if (!dq->items) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    dq->items[dq->tail++] = *item;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static int deque_pop(WorkDeque *dq, WalkItem *item, int steal) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head == dq->tail) {
+        pthread_mutex_unlock(&dq->lock);
+        return 0;
+    }
+    if (steal) {
+        *item = dq->items[dq->head++];
+    } else {
+        *item = dq->items[--dq->tail];
+    }
+    if (dq->head == dq->tail) {
+        dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return 1;
+}
+
+static void walk_error(Walker *walker, const char *path, int error) {
+    if (walker->error) {
+        walker->error(path, error, walker->arg);
+    }
+    __atomic_store_n(&walker->errors, 1, __ATOMIC_RELAXED);
+}
+
+static int walk_open(const WalkItem *item) {
+    int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+    if (!item->parent) {
+        return open(item->path, flags);
+    }
+    int fd = openat(item->parent->fd, item->path + item->name_offset, flags);
+    // Out of descriptors while many parents are held open: go by path
+    if (fd == -1 && (errno == EMFILE || errno == ENFILE)) {
+        fd = open(item->path, flags);
+    }
+    return fd;
+}
+
+// Read one directory, visit its entries and queue its subdirectories
+static void walk_directory(Walker *walker, int worker, WalkItem *item, char *dents) {
+    int dir_fd = walk_open(item);
+    int open_error = errno;
+    walk_dir_release(walker, item->parent);
+    if (dir_fd == -1) {
+        walk_error(walker, item->path, open_error);
+        return;
+    }
+    WalkDir *self = NULL;
+    if (__atomic_add_fetch(&walker->shared_dirs, 1, __ATOMIC_RELAXED) <= walker->max_shared_dirs) {
+        self = (WalkDir *)malloc(sizeof(WalkDir));
+        if (!self) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        self->fd = dir_fd;
+        self->refs = 1;
+    } else {
+        __atomic_sub_fetch(&walker->shared_dirs, 1, __ATOMIC_RELAXED);
+    }
+
+    size_t base_len = strlen(item->path);
+    int add_slash = base_len > 0 && item->path[base_len - 1] != '/';
+    char path[PATH_MAX];
+    memcpy(path, item->path, base_len);
+    if (add_slash) {
+        path[base_len++] = '/';
+    }
+
+    while (1) {
+        long n = syscall(SYS_getdents64, dir_fd, dents, DENTS_BUFFER_SIZE);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            walk_error(walker, item->path, errno);
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t name_len = strlen(name);
+            if (base_len + name_len >= sizeof(path)) {
+                walk_error(walker, item->path, ENAMETOOLONG);
+                continue;
+            }
+            memcpy(path + base_len, name, name_len + 1);
+
+            WalkEntry entry;
+            entry.path = path;
+            entry.name = path + base_len;
+            entry.dir_fd = dir_fd;
+            entry.type = d->d_type;
+            entry.depth = item->depth + 1;
+            entry.worker = worker;
+            if (entry.type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                    entry.type = walk_mode_type(st.st_mode);
+                }
+            }
+
+            int action = walker->visit(&entry, walker->arg);
+            if (entry.type == DT_DIR && action != WALK_PRUNE &&
+                (walker->max_depth < 0 || entry.depth < walker->max_depth)) {
+                WalkItem sub;
+                sub.path = strdup(path);
+                if (!sub.path) {
+                    perror("strdup");
+                    exit(EXIT_FAILURE);
+                }
+                sub.name_offset = base_len;
+                sub.parent = self;
+                sub.depth = entry.depth;
+                if (self) {
+                    __atomic_add_fetch(&self->refs, 1, __ATOMIC_RELAXED);
+                }
+                __atomic_add_fetch(&walker->pending, 1, __ATOMIC_RELAXED);
+                deque_push(&walker->deques[worker], &sub);
+            }
+        }
+    }
+    if (self) {
+        walk_dir_release(walker, self);
+    } else {
+        close(dir_fd);
+    }
+}
+
+static void *walk_worker(void *raw) {
+    WorkerArgs *args = (WorkerArgs *)raw;
+    Walker *walker = args->walker;
+    int self = args->index;
+    char *dents = (char *)malloc(DENTS_BUFFER_SIZE);
+    if (!dents) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int idle_rounds = 0;
+    while (1) {
+        WalkItem item;
+        int found = deque_pop(&walker->deques[self], &item, 0);
+        for (int i = 1; !found && i < walker->threads; i++) {
+            found = deque_pop(&walker->deques[(self + i) % walker->threads], &item, 1);
+        }
+        if (!found) {
+            if (__atomic_load_n(&walker->pending, __ATOMIC_ACQUIRE) == 0) {
+                break;
+            }
+            // Others are still reading directories that may yield work
+            if (++idle_rounds < 64) {
+                sched_yield();
+            } else {
+                struct timespec nap = {0, 50000};
+                nanosleep(&nap, NULL);
+            }
+            continue;
+        }
+        idle_rounds = 0;
+        walk_directory(walker, self, &item, dents);
+        free(item.path);
+        __atomic_sub_fetch(&walker->pending, 1, __ATOMIC_RELEASE);
+    }
+    free(dents);
+    return NULL;
+}
+
+// Visit root and everything below it with the given number of threads.
+// error may be NULL. Returns 0, or 1 if some entry could not be read.
+static int walk_tree(const char *root, int threads, int max_depth, WalkVisitFn visit,
+                     WalkErrorFn error, void *arg) {
+    struct stat st;
+    if (lstat(root, &st) == -1) {
+        if (error) {
+            error(root, errno, arg);
+        }
+        return 1;
+    }
+
+    WalkEntry entry;
+    entry.path = root;
+    entry.name = root;
+    entry.dir_fd = AT_FDCWD;
+    entry.type = walk_mode_type(st.st_mode);
+    entry.depth = 0;
+    entry.worker = 0;
+    if (visit(&entry, arg) == WALK_PRUNE || entry.type != DT_DIR || max_depth == 0) {
+        return 0;
+    }
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    Walker walker;
+    walker.deques = (WorkDeque *)calloc(threads, sizeof(WorkDeque));
+    pthread_t *tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    WorkerArgs *args = (WorkerArgs *)malloc(threads * sizeof(WorkerArgs));
+    WalkItem start;
+    start.path = strdup(root);
+    if (!walker.deques || !tids || !args || !start.path) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    walker.threads = threads;
+    walker.max_depth = max_depth;
+    walker.pending = 1;
+    walker.errors = 0;
+    // Each thread also holds the directory it is reading
+    struct rlimit limit;
+    walker.shared_dirs = 0;
+    walker.max_shared_dirs = 0;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        rlim_t budget = limit.rlim_cur == RLIM_INFINITY ? 4096 : limit.rlim_cur / 2;
+        if (budget > 4096) {
+            budget = 4096;
+        }
+        if (budget > (rlim_t)threads) {
+            walker.max_shared_dirs = (long)(budget - threads);
+        }
+    }
+    walker.visit = visit;
+    walker.error = error;
+    walker.arg = arg;
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+    }
+    start.name_offset = 0;
+    start.parent = NULL;
+    start.depth = 0;
+    deque_push(&walker.deques[0], &start);
+
+    int started = 1;
+    for (int i = 0; i < threads; i++) {
+        args[i].walker = &walker;
+        args[i].index = i;
+        if (i > 0) {
+            // Fewer helpers is fine; stealing keeps the rest busy
+            if (pthread_create(&tids[i], NULL, walk_worker, &args[i]) != 0) {
+                break;
+            }
+            started++;
+        }
+    }
+    walk_worker(&args[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&walker.deques[i].lock);
+        free(walker.deques[i].items);
+    }
+    free(walker.deques);
+    free(tids);
+    free(args);
+    return walker.errors;
+}
+
+#endif